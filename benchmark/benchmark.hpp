@@ -0,0 +1,307 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <omp.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// ------------------------------------------------------
+// Benchmark harness
+
+// Every measurement runs config.warmup untimed repetitions and then config.repetitions timed ones, and is reported
+// as median, p95, standard deviation, mean and minimum. Work that is not part of the measured stage (copying the
+// input, writing results) goes in the setup callback, which runs before each repetition outside the timer.
+// Results are written to a CSV and a JSON file. The columns are the module's own schema (BENCHMARK_COLUMNS and
+// the like, whose "time" column holds the median) followed by BENCHMARK_STATISTICS_COLUMNS.
+
+const unsigned int DEFAULT_BENCHMARK_WARMUP = 2;
+const unsigned int DEFAULT_BENCHMARK_REPETITIONS = 10;
+const string BENCHMARK_STATISTICS_COLUMNS = "stage,repetitions,median,p95,stddev,mean,min";
+
+enum class BenchmarkStage
+{
+	DECODE,
+	COMPUTE,
+	ENCODE
+};
+
+string parseBenchmarkStage(BenchmarkStage stage)
+{
+	switch (stage)
+	{
+	case BenchmarkStage::DECODE:
+		return "decode";
+	case BenchmarkStage::COMPUTE:
+		return "compute";
+	case BenchmarkStage::ENCODE:
+		return "encode";
+	default:
+		return "unknown";
+	}
+}
+
+struct BenchmarkConfig
+{
+	unsigned int warmup;
+	unsigned int repetitions;
+	vector<unsigned int> threadCounts;
+};
+
+// 1, 2, 4, ... up to maxThreads, always ending at maxThreads
+vector<unsigned int> getThreadSweep(unsigned int maxThreads)
+{
+	vector<unsigned int> threadCounts;
+	for (unsigned int threads = 1; threads < maxThreads; threads *= 2)
+	{
+		threadCounts.push_back(threads);
+	}
+	threadCounts.push_back(max(maxThreads, 1u));
+	return threadCounts;
+}
+
+BenchmarkConfig createBenchmarkConfig(unsigned int maxThreads, unsigned int warmup = DEFAULT_BENCHMARK_WARMUP, unsigned int repetitions = DEFAULT_BENCHMARK_REPETITIONS)
+{
+	BenchmarkConfig config = {warmup, max(repetitions, 1u), getThreadSweep(maxThreads)};
+	return config;
+}
+
+struct TimingStatistics
+{
+	unsigned int repetitions;
+	double median;
+	double p95;
+	double stddev;
+	double mean;
+	double minimum;
+};
+
+TimingStatistics computeTimingStatistics(vector<double> samples)
+{
+	TimingStatistics statistics = {static_cast<unsigned int>(samples.size()), 0.0, 0.0, 0.0, 0.0, 0.0};
+	if (samples.empty())
+	{
+		return statistics;
+	}
+	sort(samples.begin(), samples.end());
+	size_t count = samples.size();
+	statistics.median = count % 2 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2.0;
+	// Nearest-rank percentile
+	statistics.p95 = samples[static_cast<size_t>(ceil(0.95 * count)) - 1];
+	statistics.minimum = samples.front();
+	for (double sample : samples)
+	{
+		statistics.mean += sample;
+	}
+	statistics.mean /= count;
+	for (double sample : samples)
+	{
+		statistics.stddev += (sample - statistics.mean) * (sample - statistics.mean);
+	}
+	statistics.stddev = count > 1 ? sqrt(statistics.stddev / (count - 1)) : 0.0;
+	return statistics;
+}
+
+TimingStatistics measure(const BenchmarkConfig &config, const function<void()> &run, const function<void()> &setup = function<void()>())
+{
+	vector<double> samples;
+	for (unsigned int repetition = 0; repetition < config.warmup + config.repetitions; ++repetition)
+	{
+		if (setup)
+		{
+			setup();
+		}
+		double startTime = omp_get_wtime();
+		run();
+		double endTime = omp_get_wtime();
+		if (repetition >= config.warmup)
+		{
+			samples.push_back(endTime - startTime);
+		}
+	}
+	return computeTimingStatistics(samples);
+}
+
+// to_string() keeps six decimals, which rounds the fastest kernels to zero
+string formatBenchmarkNumber(double value)
+{
+	ostringstream text;
+	text << setprecision(9) << value;
+	return text.str();
+}
+
+struct BenchmarkReport
+{
+	vector<string> columns;
+	fstream csv;
+	fstream json;
+	size_t rows;
+};
+
+vector<string> splitColumns(const string &columns)
+{
+	vector<string> names;
+	size_t start = 0;
+	while (start <= columns.size())
+	{
+		size_t end = columns.find(',', start);
+		if (end == string::npos)
+		{
+			end = columns.size();
+		}
+		names.push_back(columns.substr(start, end - start));
+		start = end + 1;
+	}
+	return names;
+}
+
+// results.csv -> results.json
+string getJsonReportPath(const string &csvPath)
+{
+	size_t extension = csvPath.rfind(".csv");
+	return (extension == string::npos ? csvPath : csvPath.substr(0, extension)) + ".json";
+}
+
+// Opens the CSV and its JSON twin; columns is the module's schema, without the statistics columns
+bool openBenchmarkReport(BenchmarkReport &report, const string &csvPath, const string &columns)
+{
+	report.columns = splitColumns(columns + "," + BENCHMARK_STATISTICS_COLUMNS);
+	report.rows = 0;
+	report.csv.open(csvPath, ios::out | ios::trunc);
+	report.json.open(getJsonReportPath(csvPath), ios::out | ios::trunc);
+	if (!report.csv.is_open() || !report.json.is_open())
+	{
+		return false;
+	}
+	report.csv << columns << "," << BENCHMARK_STATISTICS_COLUMNS << endl;
+	report.json << "[";
+	return true;
+}
+
+// value as a JSON string, with quotes, backslashes and control characters escaped
+string quoteJsonString(const string &value)
+{
+	string quoted = "\"";
+	for (char character : value)
+	{
+		if (character == '"' || character == '\\')
+		{
+			quoted += '\\';
+			quoted += character;
+		}
+		else if (static_cast<unsigned char>(character) < 0x20)
+		{
+			char escaped[7];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", character);
+			quoted += escaped;
+		}
+		else
+		{
+			quoted += character;
+		}
+	}
+	return quoted + "\"";
+}
+
+// Whether value is written as a JSON number: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+bool isJsonNumber(const string &value)
+{
+	size_t i = 0;
+	auto skipDigits = [&]() {
+		size_t start = i;
+		while (i < value.size() && isdigit(static_cast<unsigned char>(value[i])))
+		{
+			++i;
+		}
+		return i - start;
+	};
+	if (i < value.size() && value[i] == '-')
+	{
+		++i;
+	}
+	if (i < value.size() && value[i] == '0')
+	{
+		++i;
+	}
+	else if (skipDigits() == 0)
+	{
+		return false;
+	}
+	if (i < value.size() && value[i] == '.')
+	{
+		++i;
+		if (skipDigits() == 0)
+		{
+			return false;
+		}
+	}
+	if (i < value.size() && (value[i] == 'e' || value[i] == 'E'))
+	{
+		++i;
+		if (i < value.size() && (value[i] == '+' || value[i] == '-'))
+		{
+			++i;
+		}
+		if (skipDigits() == 0)
+		{
+			return false;
+		}
+	}
+	return i == value.size();
+}
+
+// Numbers are written bare and strings quoted. JSON has no infinity or NaN, so the text formatBenchmarkNumber()
+// gives those (a throughput over a zero time, for instance) is written as null.
+string formatJsonValue(const string &value)
+{
+	if (isJsonNumber(value))
+	{
+		return value;
+	}
+	char *end = nullptr;
+	double number = strtod(value.c_str(), &end);
+	if (!value.empty() && *end == '\0' && !isfinite(number))
+	{
+		return "null";
+	}
+	return quoteJsonString(value);
+}
+
+// values follows the module's columns; the statistics columns are appended from statistics
+void writeBenchmarkResult(BenchmarkReport &report, const vector<string> &values, BenchmarkStage stage, const TimingStatistics &statistics)
+{
+	vector<string> row(values);
+	row.push_back(parseBenchmarkStage(stage));
+	row.push_back(to_string(statistics.repetitions));
+	double metrics[] = {statistics.median, statistics.p95, statistics.stddev, statistics.mean, statistics.minimum};
+	for (double metric : metrics)
+	{
+		row.push_back(formatBenchmarkNumber(metric));
+	}
+
+	report.json << (report.rows == 0 ? "\n" : ",\n") << "  {";
+	for (size_t i = 0; i < row.size(); ++i)
+	{
+		report.csv << (i == 0 ? "" : ",") << row[i];
+		report.json << (i == 0 ? "" : ", ") << "\"" << (i < report.columns.size() ? report.columns[i] : "column_" + to_string(i)) << "\": " << formatJsonValue(row[i]);
+	}
+	report.csv << endl;
+	report.json << "}";
+	++report.rows;
+}
+
+void closeBenchmarkReport(BenchmarkReport &report)
+{
+	report.json << "\n]" << endl;
+	report.csv.close();
+	report.json.close();
+}
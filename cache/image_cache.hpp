@@ -0,0 +1,245 @@
+#pragma once
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <opencv2/opencv.hpp>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../trace/trace.hpp"
+
+using namespace std;
+using namespace cv;
+
+// ------------------------------------------------------
+// Decoded image cache
+
+// Decoding a large TIFF or JPEG costs more than most kernels that run on it, so decoded pixels are kept in
+// raw files next to the source, under IMAGE_CACHE_DIRECTORY. A cache file is a RawImageHeader followed, at
+// dataOffset (a page boundary), by rows * stride bytes of pixels. It is mapped MAP_PRIVATE straight into the
+// returned Mat: pages are shared with the page cache until a caller writes to them, and writes never reach
+// the file. The cache file is rebuilt when the source's size or modification time changes.
+
+const string IMAGE_CACHE_DIRECTORY = ".cache/";
+const string IMAGE_CACHE_EXTENSION = ".raw";
+const char IMAGE_CACHE_MAGIC[4] = {'R', 'I', 'M', 'G'};
+const uint32_t IMAGE_CACHE_VERSION = 1;
+const uint64_t IMAGE_CACHE_DATA_OFFSET = 4096;
+
+struct RawImageHeader
+{
+	char magic[4];
+	uint32_t version;
+	int32_t rows;
+	int32_t columns;
+	int32_t type;
+	int32_t flags;
+	uint64_t stride;
+	uint64_t dataOffset;
+	int64_t sourceSize;
+	int64_t sourceModifiedSeconds;
+	int64_t sourceModifiedNanoseconds;
+};
+
+struct MappedRegion
+{
+	void *address;
+	size_t length;
+};
+
+// Hands a mapping to the next Mat::create() on this thread
+MappedRegion *&pendingMappedRegion()
+{
+	static thread_local MappedRegion *region = nullptr;
+	return region;
+}
+
+// Lets a Mat own a mapped cache file: the mapping is released with the last Mat that references it
+class MappedImageAllocator : public MatAllocator
+{
+public:
+	UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step, AccessFlag flags, UMatUsageFlags usageFlags) const override
+	{
+		MappedRegion *region = pendingMappedRegion();
+		if (!region || data)
+		{
+			return Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+		}
+		pendingMappedRegion() = nullptr;
+		size_t total = CV_ELEM_SIZE(type);
+		for (int i = dims - 1; i >= 0; --i)
+		{
+			if (step)
+			{
+				step[i] = total;
+			}
+			total *= sizes[i];
+		}
+		UMatData *u = new UMatData(this);
+		u->data = u->origdata = static_cast<uchar *>(region->address) + IMAGE_CACHE_DATA_OFFSET;
+		u->size = total;
+		u->handle = region;
+		return u;
+	}
+
+	bool allocate(UMatData *u, AccessFlag flags, UMatUsageFlags usageFlags) const override
+	{
+		return u != nullptr;
+	}
+
+	void deallocate(UMatData *u) const override
+	{
+		if (!u)
+		{
+			return;
+		}
+		MappedRegion *region = static_cast<MappedRegion *>(u->handle);
+		munmap(region->address, region->length);
+		delete region;
+		delete u;
+	}
+};
+
+MappedImageAllocator &getMappedImageAllocator()
+{
+	static MappedImageAllocator allocator;
+	return allocator;
+}
+
+// <directory>/.cache/<name>.<flags>.raw, so color and unchanged reads of the same file do not collide
+string getImageCachePath(const string &path, int flags)
+{
+	size_t separator = path.find_last_of('/');
+	string directory = separator == string::npos ? "" : path.substr(0, separator + 1);
+	string name = separator == string::npos ? path : path.substr(separator + 1);
+	return directory + IMAGE_CACHE_DIRECTORY + name + "." + to_string(flags) + IMAGE_CACHE_EXTENSION;
+}
+
+bool writeAll(int descriptor, const void *data, size_t length)
+{
+	const char *bytes = static_cast<const char *>(data);
+	while (length > 0)
+	{
+		ssize_t written = write(descriptor, bytes, length);
+		if (written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (written <= 0)
+		{
+			return false;
+		}
+		bytes += written;
+		length -= written;
+	}
+	return true;
+}
+
+// Maps a cache file into a Mat if it exists and still matches the source; returns an empty Mat otherwise
+Mat mapCachedImage(const string &cachePath, const struct stat &source, int flags)
+{
+	int descriptor = open(cachePath.c_str(), O_RDONLY);
+	if (descriptor < 0)
+	{
+		return Mat();
+	}
+	struct stat cache;
+	RawImageHeader header;
+	bool valid = fstat(descriptor, &cache) == 0 && pread(descriptor, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header));
+	valid = valid && memcmp(header.magic, IMAGE_CACHE_MAGIC, sizeof(IMAGE_CACHE_MAGIC)) == 0 && header.version == IMAGE_CACHE_VERSION && header.flags == flags;
+	valid = valid && header.sourceSize == source.st_size && header.sourceModifiedSeconds == source.st_mtim.tv_sec && header.sourceModifiedNanoseconds == source.st_mtim.tv_nsec;
+	valid = valid && header.rows > 0 && header.columns > 0 && header.dataOffset == IMAGE_CACHE_DATA_OFFSET;
+	valid = valid && header.stride == header.columns * CV_ELEM_SIZE(header.type) && static_cast<uint64_t>(cache.st_size) == header.dataOffset + header.rows * header.stride;
+	if (!valid)
+	{
+		close(descriptor);
+		return Mat();
+	}
+
+	size_t length = cache.st_size;
+	void *address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0);
+	close(descriptor);
+	if (address == MAP_FAILED)
+	{
+		return Mat();
+	}
+	MappedRegion *region = new MappedRegion();
+	region->address = address;
+	region->length = length;
+	pendingMappedRegion() = region;
+	Mat image;
+	image.allocator = &getMappedImageAllocator();
+	image.create(header.rows, header.columns, header.type);
+	image.allocator = nullptr;
+	return image;
+}
+
+// Writes a cache file through a temporary file and a rename, so concurrent readers never see a partial file
+void writeCachedImage(const string &cachePath, const Mat &image, const struct stat &source, int flags)
+{
+	size_t separator = cachePath.find_last_of('/');
+	if (separator != string::npos)
+	{
+		mkdir(cachePath.substr(0, separator).c_str(), 0755);
+	}
+	string temporaryPath = cachePath + ".XXXXXX";
+	int descriptor = mkstemp(&temporaryPath[0]);
+	if (descriptor < 0)
+	{
+		return;
+	}
+
+	RawImageHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, IMAGE_CACHE_MAGIC, sizeof(IMAGE_CACHE_MAGIC));
+	header.version = IMAGE_CACHE_VERSION;
+	header.rows = image.rows;
+	header.columns = image.cols;
+	header.type = image.type();
+	header.flags = flags;
+	header.stride = image.cols * image.elemSize();
+	header.dataOffset = IMAGE_CACHE_DATA_OFFSET;
+	header.sourceSize = source.st_size;
+	header.sourceModifiedSeconds = source.st_mtim.tv_sec;
+	header.sourceModifiedNanoseconds = source.st_mtim.tv_nsec;
+
+	vector<char> headerPage(IMAGE_CACHE_DATA_OFFSET, 0);
+	memcpy(headerPage.data(), &header, sizeof(header));
+	bool written = writeAll(descriptor, headerPage.data(), headerPage.size());
+	for (int y = 0; written && y < image.rows; ++y)
+	{
+		written = writeAll(descriptor, image.ptr(y), header.stride);
+	}
+	close(descriptor);
+	if (!written || rename(temporaryPath.c_str(), cachePath.c_str()) != 0)
+	{
+		unlink(temporaryPath.c_str());
+	}
+}
+
+// Drop-in for imread(): maps the decoded pixels from the cache, or decodes the source and fills the cache
+Mat readCachedImage(const string &path, int flags = IMREAD_COLOR)
+{
+	TraceRegion trace("readCachedImage");
+	struct stat source;
+	if (stat(path.c_str(), &source) != 0)
+	{
+		return imread(path, flags);
+	}
+	string cachePath = getImageCachePath(path, flags);
+	Mat image = mapCachedImage(cachePath, source, flags);
+	if (!image.empty())
+	{
+		return image;
+	}
+	image = imread(path, flags);
+	if (!image.empty())
+	{
+		writeCachedImage(cachePath, image, source, flags);
+	}
+	return image;
+}
@@ -5,10 +5,15 @@
 #include <numeric>
 #include <omp.h>
 #include <opencv2/opencv.hpp>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string>
 #include <tuple>
 #include <vector>
+#include "../benchmark/benchmark.hpp"
+#include "../cache/image_cache.hpp"
+#include "../kernels/kernels.hpp"
+#include "../parallel/execution.hpp"
 
 using namespace std;
 using namespace cv;
@@ -18,8 +23,11 @@ using namespace cv;
 
 const string COMPRESSION_IMAGES_PATH = "../images/compression/";
 const string COMPRESSION_IMAGES_PATH_PROCESSED = "../images/compression/processed/";
-const string BENCHMARK_COLUMNS = "image,resolution,number_of_pixels,compression_rate,pixel_group_quantity,pixel_group_quantity_per_thread,threads,time";
+const string BENCHMARK_COLUMNS = "image,resolution,number_of_pixels,compression_rate,pixel_group_quantity,pixel_group_quantity_per_thread,threads,time,tile_size,backend";
 const string BENCHMARK_RESULTS = "compression_results.csv";
+// Side of the square tiles the parallel compressors hand out to threads, in pixels. 256x256 BGR pixels
+// are 192 KiB, which keeps the rows a thread is working on inside its L2 cache.
+const unsigned int DEFAULT_TILE_SIZE = 256;
 
 // ------------------------------------------------------
 // Utility functions
@@ -66,6 +74,20 @@ string parseImageCompressionRate(ImageCompressionRate rate)
 	}
 }
 
+// Looks a rate up by the name parseImageCompressionRate() gives it; returns false for unknown names
+bool findImageCompressionRate(const string &name, ImageCompressionRate &rate)
+{
+	for (ImageCompressionRate candidate : AllImageCompressionRates)
+	{
+		if (parseImageCompressionRate(candidate) == name)
+		{
+			rate = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
 vector<tuple<unsigned int, unsigned int>> getTopLeftPixelIndexes(unsigned int rows, unsigned int columns, ImageCompressionRate rate)
 {
 	unsigned int compressionRate = static_cast<unsigned int>(rate);
@@ -126,31 +148,176 @@ Vec3b getAverageFromPixelGroup(Mat image, vector<tuple<unsigned int, unsigned in
 	return Vec3b(redAverage, greenAverage, blueAverage);
 }
 
-Mat compressImage(Mat image, ImageCompressionRate rate, size_t &pixelGroupQuantity)
+size_t getPixelGroupQuantity(unsigned int rows, unsigned int columns, ImageCompressionRate rate)
+{
+	size_t compressionRate = static_cast<size_t>(rate);
+	return ((rows + compressionRate - 1) / compressionRate) * ((columns + compressionRate - 1) / compressionRate);
+}
+
+// Scratch memory reused by a thread across the block-rows it compresses.
+struct BlockRowBuffers
+{
+	vector<unsigned short> columnSums;
+	vector<Vec3b> averages;
+};
+
+// Computes the average of every block whose top edge is at row top and whose columns lie in
+// [left, right), and stores it in averages, which is indexed by block column. left must be a
+// multiple of Rate. The rows of the block-row are first summed column by column into
+// columnSums, then each block reduces its Rate columns per channel.
+// Blocks on the right and bottom edges are clipped to the image when its size is not a multiple of the rate.
+template <unsigned int Rate>
+void averageBlockRow(const Mat &image, unsigned int top, unsigned int left, unsigned int right, vector<unsigned short> &columnSums, Vec3b *averages)
+{
+	unsigned int bottom = min(top + Rate, static_cast<unsigned int>(image.rows));
+	unsigned int blockHeight = bottom - top;
+	size_t rowLength = static_cast<size_t>(right - left) * 3;
+
+	columnSums.assign(rowLength, 0);
+	for (unsigned int y = top; y < bottom; ++y)
+	{
+		accumulateRow(image.ptr<uchar>(y) + left * 3, columnSums.data(), rowLength);
+	}
+
+	unsigned int fullBlockRight = right - (right - left) % Rate;
+	for (unsigned int blockLeft = left; blockLeft < fullBlockRight; blockLeft += Rate)
+	{
+		const unsigned short *sums = columnSums.data() + (blockLeft - left) * 3;
+		unsigned int redSum = 0, greenSum = 0, blueSum = 0;
+		for (unsigned int x = 0; x < Rate; ++x)
+		{
+			redSum += sums[x * 3];
+			greenSum += sums[x * 3 + 1];
+			blueSum += sums[x * 3 + 2];
+		}
+		unsigned int pixelQuantity = blockHeight * Rate;
+		averages[blockLeft / Rate] = Vec3b(redSum / pixelQuantity, greenSum / pixelQuantity, blueSum / pixelQuantity);
+	}
+	if (fullBlockRight < right)
+	{
+		const unsigned short *sums = columnSums.data() + (fullBlockRight - left) * 3;
+		unsigned int blockWidth = right - fullBlockRight;
+		unsigned int redSum = 0, greenSum = 0, blueSum = 0;
+		for (unsigned int x = 0; x < blockWidth; ++x)
+		{
+			redSum += sums[x * 3];
+			greenSum += sums[x * 3 + 1];
+			blueSum += sums[x * 3 + 2];
+		}
+		unsigned int pixelQuantity = blockHeight * blockWidth;
+		averages[fullBlockRight / Rate] = Vec3b(redSum / pixelQuantity, greenSum / pixelQuantity, blueSum / pixelQuantity);
+	}
+}
+
+void averageBlockRow(const Mat &image, unsigned int top, unsigned int left, unsigned int right, ImageCompressionRate rate, vector<unsigned short> &columnSums, Vec3b *averages)
+{
+	switch (rate)
+	{
+	case ImageCompressionRate::LOW:
+		averageBlockRow<2>(image, top, left, right, columnSums, averages);
+		break;
+	case ImageCompressionRate::MEDIUM:
+		averageBlockRow<4>(image, top, left, right, columnSums, averages);
+		break;
+	case ImageCompressionRate::HIGH:
+		averageBlockRow<8>(image, top, left, right, columnSums, averages);
+		break;
+	case ImageCompressionRate::VERY_HIGH:
+		averageBlockRow<16>(image, top, left, right, columnSums, averages);
+		break;
+	}
+}
+
+// Writes columns [left, right) of a row expanded from the block averages of blockSize pixels wide blocks.
+// row points at the pixel of column left.
+void expandRow(const Vec3b *averages, unsigned int blockSize, unsigned int left, unsigned int right, Vec3b *row)
+{
+	unsigned int x = left;
+	while (x < right)
+	{
+		unsigned int blockColumn = x / blockSize;
+		unsigned int blockRight = min((blockColumn + 1) * blockSize, right);
+		Vec3b average = averages[blockColumn];
+		for (; x < blockRight; ++x)
+		{
+			row[x - left] = average;
+		}
+	}
+}
+
+// Writes the block averages over rows [top, bottom) and columns [left, right) of image: the first row
+// is expanded and then copied to the others. averages is indexed by block column.
+void expandBlockRow(Mat &image, unsigned int top, unsigned int bottom, unsigned int left, unsigned int right, unsigned int blockSize, const Vec3b *averages)
+{
+	Vec3b *firstRow = image.ptr<Vec3b>(top) + left;
+	expandRow(averages, blockSize, left, right, firstRow);
+	for (unsigned int y = top + 1; y < bottom; ++y)
+	{
+		memcpy(image.ptr<Vec3b>(y) + left, firstRow, static_cast<size_t>(right - left) * 3);
+	}
+}
+
+// Averages every block whose top edge is at row top and whose columns lie in [left, right),
+// and writes the average back over the block.
+void compressBlockRow(Mat &image, unsigned int top, unsigned int left, unsigned int right, ImageCompressionRate rate, BlockRowBuffers &buffers)
 {
-	Mat compressedImage;
 	unsigned int compressionRate = static_cast<unsigned int>(rate);
-	vector<vector<tuple<unsigned int, unsigned int>>> pixelGroups = getAllPixelGroups(image, rate);
-	pixelGroupQuantity = pixelGroups.size();
-	for (size_t i = 0; i < pixelGroups.size(); ++i)
+	unsigned int bottom = min(top + compressionRate, static_cast<unsigned int>(image.rows));
+	buffers.averages.resize((image.cols + compressionRate - 1) / compressionRate);
+	averageBlockRow(image, top, left, right, rate, buffers.columnSums, buffers.averages.data());
+	expandBlockRow(image, top, bottom, left, right, compressionRate, buffers.averages.data());
+}
+
+// A rectangle of whole blocks of the image: rows [top, bottom) and columns [left, right).
+struct CompressionTile
+{
+	unsigned int top;
+	unsigned int bottom;
+	unsigned int left;
+	unsigned int right;
+};
+
+// Splits the image in tiles of tileSize pixels rounded down to whole blocks (at least one block).
+vector<CompressionTile> getCompressionTiles(unsigned int rows, unsigned int columns, unsigned int compressionRate, unsigned int tileSize)
+{
+	unsigned int tileSide = max(compressionRate, tileSize / compressionRate * compressionRate);
+	vector<CompressionTile> tiles;
+	for (unsigned int top = 0; top < rows; top += tileSide)
 	{
-		Vec3b average = getAverageFromPixelGroup(image, pixelGroups[i]);
-		for (size_t j = 0; j < pixelGroups[i].size(); ++j)
+		for (unsigned int left = 0; left < columns; left += tileSide)
 		{
-			unsigned int x = get<0>(pixelGroups[i][j]);
-			unsigned int y = get<1>(pixelGroups[i][j]);
-			image.at<Vec3b>(Point(x, y)) = average;
+			CompressionTile tile = {top, min(top + tileSide, rows), left, min(left + tileSide, columns)};
+			tiles.push_back(tile);
 		}
 	}
+	return tiles;
+}
+
+Mat compressImage(Mat image, ImageCompressionRate rate, size_t &pixelGroupQuantity)
+{
+	unsigned int compressionRate = static_cast<unsigned int>(rate);
+	pixelGroupQuantity = getPixelGroupQuantity(image.rows, image.cols, rate);
+	BlockRowBuffers buffers;
+	for (unsigned int top = 0; top < static_cast<unsigned int>(image.rows); top += compressionRate)
+	{
+		compressBlockRow(image, top, 0, image.cols, rate, buffers);
+	}
 	return image;
 }
 
-Mat compressImageThreads(Mat image, ImageCompressionRate rate, size_t &pixelGroupQuantity, size_t &pixelGroupQuantityPerThread, int threads)
+// Tiles of tileSize pixels are handed out to the threads dynamically, so threads that finish early
+// pick up the remaining tiles instead of waiting on a fixed share of the image. The tiles run on the
+// current execution backend.
+Mat compressImageThreads(Mat image, ImageCompressionRate rate, size_t &pixelGroupQuantity, size_t &pixelGroupQuantityPerThread, int threads, unsigned int tileSize = DEFAULT_TILE_SIZE)
 {
-	Mat compressedImage;
 	unsigned int compressionRate = static_cast<unsigned int>(rate);
-	vector<vector<tuple<unsigned int, unsigned int>>> pixelGroups = getAllPixelGroups(image, rate);
-	pixelGroupQuantity = pixelGroups.size();
+	threads = max(threads, 1);
+	pixelGroupQuantity = getPixelGroupQuantity(image.rows, image.cols, rate);
+	if (pixelGroupQuantity == 0)
+	{
+		pixelGroupQuantityPerThread = 0;
+		return image;
+	}
 
 	size_t groupsPerThread = pixelGroupQuantity / threads;
 	if (groupsPerThread == 0)
@@ -160,76 +327,617 @@ Mat compressImageThreads(Mat image, ImageCompressionRate rate, size_t &pixelGrou
 	}
 	pixelGroupQuantityPerThread = groupsPerThread;
 
-#pragma omp parallel num_threads(threads)
+	TraceRegion trace("compressImageThreads", threads);
+	vector<CompressionTile> tiles = getCompressionTiles(image.rows, image.cols, compressionRate, tileSize);
+	vector<BlockRowBuffers> workerBuffers(threads);
+	parallelFor(0, tiles.size(), threads, [&](int begin, int end, int worker) {
+		BlockRowBuffers &buffers = workerBuffers[worker];
+		for (int i = begin; i < end; ++i)
+		{
+			const CompressionTile &tile = tiles[i];
+			for (unsigned int top = tile.top; top < tile.bottom; top += compressionRate)
+			{
+				compressBlockRow(image, top, tile.left, tile.right, rate, buffers);
+			}
+			addTraceWork(getPixelGroupQuantity(tile.bottom - tile.top, tile.right - tile.left, rate));
+		}
+	}, 1);
+	return image;
+}
+
+// ------------------------------------------------------
+// Compressed image storage
+
+// A compressed image kept at its reduced size: grid holds one pixel per block, and the block size
+// and original resolution are kept so the full image can be expanded back on demand.
+struct CompressedImage
+{
+	unsigned int rate;
+	unsigned int rows;
+	unsigned int columns;
+	Mat grid;
+};
+
+const string COMPRESSED_IMAGE_EXTENSION = ".cimg";
+const char COMPRESSED_IMAGE_MAGIC[4] = {'C', 'I', 'M', 'G'};
+
+CompressedImage createCompressedImage(const Mat &image, ImageCompressionRate rate)
+{
+	CompressedImage compressedImage;
+	compressedImage.rate = static_cast<unsigned int>(rate);
+	compressedImage.rows = image.rows;
+	compressedImage.columns = image.cols;
+	compressedImage.grid.create((image.rows + compressedImage.rate - 1) / compressedImage.rate, (image.cols + compressedImage.rate - 1) / compressedImage.rate, CV_8UC3);
+	return compressedImage;
+}
+
+CompressedImage compressImageGrid(const Mat &image, ImageCompressionRate rate, size_t &pixelGroupQuantity)
+{
+	CompressedImage compressedImage = createCompressedImage(image, rate);
+	pixelGroupQuantity = compressedImage.grid.total();
+	vector<unsigned short> columnSums;
+	for (int blockRow = 0; blockRow < compressedImage.grid.rows; ++blockRow)
+	{
+		averageBlockRow(image, blockRow * compressedImage.rate, 0, image.cols, rate, columnSums, compressedImage.grid.ptr<Vec3b>(blockRow));
+	}
+	return compressedImage;
+}
+
+CompressedImage compressImageGridThreads(const Mat &image, ImageCompressionRate rate, size_t &pixelGroupQuantity, size_t &pixelGroupQuantityPerThread, int threads, unsigned int tileSize = DEFAULT_TILE_SIZE)
+{
+	CompressedImage compressedImage = createCompressedImage(image, rate);
+	threads = max(threads, 1);
+	pixelGroupQuantity = compressedImage.grid.total();
+	pixelGroupQuantityPerThread = max(static_cast<size_t>(1), pixelGroupQuantity / threads);
+	vector<CompressionTile> tiles = getCompressionTiles(image.rows, image.cols, compressedImage.rate, tileSize);
+	vector<vector<unsigned short> > workerColumnSums(threads);
+	parallelFor(0, tiles.size(), threads, [&](int begin, int end, int worker) {
+		vector<unsigned short> &columnSums = workerColumnSums[worker];
+		for (int i = begin; i < end; ++i)
+		{
+			const CompressionTile &tile = tiles[i];
+			for (unsigned int top = tile.top; top < tile.bottom; top += compressedImage.rate)
+			{
+				averageBlockRow(image, top, tile.left, tile.right, rate, columnSums, compressedImage.grid.ptr<Vec3b>(top / compressedImage.rate));
+			}
+		}
+	}, 1);
+	return compressedImage;
+}
+
+// Expands the region of the original image covered by region, clipped to the image.
+Mat expandCompressedImageRegion(const CompressedImage &compressedImage, Rect region)
+{
+	region = region & Rect(0, 0, compressedImage.columns, compressedImage.rows);
+	Mat image(region.height, region.width, CV_8UC3);
+	for (int y = 0; y < region.height; ++y)
+	{
+		const Vec3b *averages = compressedImage.grid.ptr<Vec3b>((region.y + y) / compressedImage.rate);
+		expandRow(averages, compressedImage.rate, region.x, region.x + region.width, image.ptr<Vec3b>(y));
+	}
+	return image;
+}
+
+Mat expandCompressedImage(const CompressedImage &compressedImage, int threads)
+{
+	Mat image(compressedImage.rows, compressedImage.columns, CV_8UC3);
+#pragma omp parallel for num_threads(threads) schedule(static)
+	for (int blockRow = 0; blockRow < compressedImage.grid.rows; ++blockRow)
+	{
+		unsigned int top = blockRow * compressedImage.rate;
+		unsigned int bottom = min(top + compressedImage.rate, compressedImage.rows);
+		expandBlockRow(image, top, bottom, 0, compressedImage.columns, compressedImage.rate, compressedImage.grid.ptr<Vec3b>(blockRow));
+	}
+	return image;
+}
+
+// Stores the header (magic, rate, rows, columns) followed by the grid encoded as a lossless PNG.
+bool saveCompressedImage(string path, const CompressedImage &compressedImage)
+{
+	TraceRegion trace("saveCompressedImage");
+	vector<uchar> encodedGrid;
+	if (!imencode(".png", compressedImage.grid, encodedGrid))
+	{
+		return false;
+	}
+	ofstream file(path, ios::binary | ios::trunc);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	uint32_t header[3] = {compressedImage.rate, compressedImage.rows, compressedImage.columns};
+	file.write(COMPRESSED_IMAGE_MAGIC, sizeof(COMPRESSED_IMAGE_MAGIC));
+	file.write(reinterpret_cast<const char *>(header), sizeof(header));
+	file.write(reinterpret_cast<const char *>(encodedGrid.data()), encodedGrid.size());
+	return file.good();
+}
+
+bool loadCompressedImage(string path, CompressedImage &compressedImage)
+{
+	TraceRegion trace("loadCompressedImage");
+	ifstream file(path, ios::binary);
+	char magic[sizeof(COMPRESSED_IMAGE_MAGIC)];
+	uint32_t header[3];
+	if (!file.read(magic, sizeof(magic)) || memcmp(magic, COMPRESSED_IMAGE_MAGIC, sizeof(magic)) != 0 || !file.read(reinterpret_cast<char *>(header), sizeof(header)))
+	{
+		return false;
+	}
+	vector<uchar> encodedGrid((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+	compressedImage.rate = header[0];
+	compressedImage.rows = header[1];
+	compressedImage.columns = header[2];
+	compressedImage.grid = imdecode(encodedGrid, IMREAD_COLOR);
+	return compressedImage.rate > 0 && !compressedImage.grid.empty() && static_cast<unsigned int>(compressedImage.grid.rows) == (compressedImage.rows + compressedImage.rate - 1) / compressedImage.rate && static_cast<unsigned int>(compressedImage.grid.cols) == (compressedImage.columns + compressedImage.rate - 1) / compressedImage.rate;
+}
+
+// ------------------------------------------------------
+// Integral image compression
+
+// Summed-area table of an image: sums holds (rows + 1) x (columns + 1) entries of three channels,
+// where entry (y, x) is the sum of every pixel above and to the left of it. The sums are kept
+// modulo 2^32; block sums taken from them are exact as long as a block holds fewer than 2^24 pixels.
+// When built with squares, every entry has a fourth channel with the sum of the squared channel values,
+// which stays exact for blocks of fewer than 22017 pixels.
+struct IntegralImage
+{
+	unsigned int rows;
+	unsigned int columns;
+	unsigned int channels;
+	vector<uint32_t> sums;
+};
+
+IntegralImage buildIntegralImage(const Mat &image, int threads, bool withSquares = false)
+{
+	IntegralImage integral;
+	integral.rows = image.rows;
+	integral.columns = image.cols;
+	integral.channels = withSquares ? 4 : 3;
+	unsigned int channels = integral.channels;
+	size_t stride = (static_cast<size_t>(image.cols) + 1) * channels;
+	integral.sums.assign((static_cast<size_t>(image.rows) + 1) * stride, 0);
+	uint32_t *sums = integral.sums.data();
+
+	// Prefix sums along each row, rows are independent
+#pragma omp parallel for num_threads(threads) schedule(static)
+	for (int y = 0; y < image.rows; ++y)
+	{
+		const uchar *row = image.ptr<uchar>(y);
+		uint32_t *sumRow = sums + (y + 1) * stride;
+		for (int x = 0; x < image.cols; ++x)
+		{
+			uint32_t squareSum = 0;
+			for (int c = 0; c < 3; ++c)
+			{
+				uint32_t value = row[x * 3 + c];
+				sumRow[(x + 1) * channels + c] = sumRow[x * channels + c] + value;
+				squareSum += value * value;
+			}
+			if (withSquares)
+			{
+				sumRow[(x + 1) * channels + 3] = sumRow[x * channels + 3] + squareSum;
+			}
+		}
+	}
+
+	// Prefix sums along each column, split into column strips so every thread walks rows contiguously
+	int strips = max(1, min(threads, static_cast<int>(stride / 64)));
+#pragma omp parallel for num_threads(threads) schedule(static)
+	for (int strip = 0; strip < strips; ++strip)
+	{
+		size_t begin = stride * strip / strips;
+		size_t end = stride * (strip + 1) / strips;
+		for (int y = 1; y <= image.rows; ++y)
+		{
+			const uint32_t *previousRow = sums + (y - 1) * stride;
+			uint32_t *sumRow = sums + y * stride;
+			for (size_t i = begin; i < end; ++i)
+			{
+				sumRow[i] += previousRow[i];
+			}
+		}
+	}
+	return integral;
+}
+
+// Average of the block with top-left corner (left, top), clipped to the image.
+Vec3b getBlockAverage(const IntegralImage &integral, unsigned int left, unsigned int top, unsigned int width, unsigned int height)
+{
+	unsigned int right = min(left + width, integral.columns);
+	unsigned int bottom = min(top + height, integral.rows);
+	unsigned int channels = integral.channels;
+	size_t stride = (static_cast<size_t>(integral.columns) + 1) * channels;
+	const uint32_t *topRow = integral.sums.data() + top * stride;
+	const uint32_t *bottomRow = integral.sums.data() + bottom * stride;
+	uint32_t pixelQuantity = (right - left) * (bottom - top);
+	Vec3b average;
+	for (unsigned int c = 0; c < 3; ++c)
+	{
+		uint32_t sum = bottomRow[right * channels + c] - bottomRow[left * channels + c] - topRow[right * channels + c] + topRow[left * channels + c];
+		average[c] = sum / pixelQuantity;
+	}
+	return average;
+}
+
+// Compresses image with blocks of blockWidth x blockHeight pixels using the sums of integral,
+// which must have been built from the same image. One table serves any number of block sizes.
+Mat compressImageIntegral(Mat image, const IntegralImage &integral, unsigned int blockWidth, unsigned int blockHeight, size_t &pixelGroupQuantity, int threads)
+{
+	unsigned int columns = image.cols;
+	int blockRows = (image.rows + blockHeight - 1) / blockHeight;
+	pixelGroupQuantity = static_cast<size_t>(blockRows) * ((columns + blockWidth - 1) / blockWidth);
+
+#pragma omp parallel for num_threads(threads) schedule(static)
+	for (int blockRow = 0; blockRow < blockRows; ++blockRow)
+	{
+		unsigned int top = blockRow * blockHeight;
+		unsigned int bottom = min(top + blockHeight, static_cast<unsigned int>(image.rows));
+		Vec3b *firstRow = image.ptr<Vec3b>(top);
+		for (unsigned int left = 0; left < columns; left += blockWidth)
+		{
+			Vec3b average = getBlockAverage(integral, left, top, blockWidth, blockHeight);
+			unsigned int right = min(left + blockWidth, columns);
+			for (unsigned int x = left; x < right; ++x)
+			{
+				firstRow[x] = average;
+			}
+		}
+		for (unsigned int y = top + 1; y < bottom; ++y)
+		{
+			memcpy(image.ptr<uchar>(y), firstRow, static_cast<size_t>(columns) * 3);
+		}
+	}
+	return image;
+}
+
+Mat compressImageIntegral(Mat image, const IntegralImage &integral, ImageCompressionRate rate, size_t &pixelGroupQuantity, int threads)
+{
+	unsigned int compressionRate = static_cast<unsigned int>(rate);
+	return compressImageIntegral(image, integral, compressionRate, compressionRate, pixelGroupQuantity, threads);
+}
+
+// ------------------------------------------------------
+// Adaptive compression
+
+// Largest variance, summed over the three channels, a region may have to be kept as a single block.
+// Like ImageCompressionRate, higher values compress more.
+enum class ImageCompressionVariance
+{
+	LOW = 25,
+	MEDIUM = 100,
+	HIGH = 400,
+	VERY_HIGH = 1600
+};
+
+// The quadtree starts from square regions of QUADTREE_MAX_BLOCK_SIZE pixels, which keeps the squared sums of
+// any region exact, and never splits a region below QUADTREE_MIN_BLOCK_SIZE pixels.
+const unsigned int QUADTREE_MAX_BLOCK_SIZE = 128;
+const unsigned int QUADTREE_MIN_BLOCK_SIZE = static_cast<unsigned int>(ImageCompressionRate::LOW);
+// Regions deeper than this are split inside the task of their parent instead of spawning new tasks.
+const int QUADTREE_TASK_CUTOFF_DEPTH = 3;
+
+string parseImageCompressionVariance(ImageCompressionVariance variance)
+{
+	switch (variance)
+	{
+	case ImageCompressionVariance::LOW:
+		return "adaptive_low";
+	case ImageCompressionVariance::MEDIUM:
+		return "adaptive_medium";
+	case ImageCompressionVariance::HIGH:
+		return "adaptive_high";
+	case ImageCompressionVariance::VERY_HIGH:
+		return "adaptive_very_high";
+	default:
+		return "unknown";
+	}
+}
+
+// Sum of the variances of the three channels inside the block, clipped to the image.
+// integral must have been built with squares.
+double getBlockVariance(const IntegralImage &integral, unsigned int left, unsigned int top, unsigned int width, unsigned int height)
+{
+	unsigned int right = min(left + width, integral.columns);
+	unsigned int bottom = min(top + height, integral.rows);
+	size_t stride = (static_cast<size_t>(integral.columns) + 1) * 4;
+	const uint32_t *topRow = integral.sums.data() + top * stride;
+	const uint32_t *bottomRow = integral.sums.data() + bottom * stride;
+	double pixelQuantity = (right - left) * (bottom - top);
+	double squaredMeans = 0.0;
+	for (int c = 0; c < 3; ++c)
 	{
-		int threadId = omp_get_thread_num();
+		uint32_t sum = bottomRow[right * 4 + c] - bottomRow[left * 4 + c] - topRow[right * 4 + c] + topRow[left * 4 + c];
+		double mean = sum / pixelQuantity;
+		squaredMeans += mean * mean;
+	}
+	uint32_t squareSum = bottomRow[right * 4 + 3] - bottomRow[left * 4 + 3] - topRow[right * 4 + 3] + topRow[left * 4 + 3];
+	return squareSum / pixelQuantity - squaredMeans;
+}
 
-		size_t startIdx = threadId * groupsPerThread;
-		size_t endIdx = (threadId == threads - 1) ? pixelGroupQuantity : startIdx + groupsPerThread;
+// Fills the square region of size pixels at (left, top) with its average when its variance is within
+// the threshold or it cannot be split further; otherwise splits it in four and recurses. The four
+// quadrants become OpenMP tasks until depth reaches cutoffDepth.
+void compressQuadtreeRegion(Mat &image, const IntegralImage &integral, unsigned int left, unsigned int top, unsigned int size, double threshold, int depth, int cutoffDepth, size_t &leafQuantity)
+{
+	if (left >= integral.columns || top >= integral.rows)
+	{
+		return;
+	}
+	if (size > QUADTREE_MIN_BLOCK_SIZE && getBlockVariance(integral, left, top, size, size) > threshold)
+	{
+		unsigned int half = size / 2;
+		if (depth < cutoffDepth)
+		{
+			for (int quadrant = 0; quadrant < 4; ++quadrant)
+			{
+				unsigned int quadrantLeft = left + (quadrant % 2) * half;
+				unsigned int quadrantTop = top + (quadrant / 2) * half;
+#pragma omp task default(none) firstprivate(quadrantLeft, quadrantTop, half, threshold, depth, cutoffDepth) shared(image, integral, leafQuantity)
+				compressQuadtreeRegion(image, integral, quadrantLeft, quadrantTop, half, threshold, depth + 1, cutoffDepth, leafQuantity);
+			}
+#pragma omp taskwait
+		}
+		else
+		{
+			for (int quadrant = 0; quadrant < 4; ++quadrant)
+			{
+				compressQuadtreeRegion(image, integral, left + (quadrant % 2) * half, top + (quadrant / 2) * half, half, threshold, depth + 1, cutoffDepth, leafQuantity);
+			}
+		}
+		return;
+	}
+
+	unsigned int right = min(left + size, integral.columns);
+	unsigned int bottom = min(top + size, integral.rows);
+	Vec3b average = getBlockAverage(integral, left, top, size, size);
+	Vec3b *firstRow = image.ptr<Vec3b>(top);
+	for (unsigned int x = left; x < right; ++x)
+	{
+		firstRow[x] = average;
+	}
+	for (unsigned int y = top + 1; y < bottom; ++y)
+	{
+		memcpy(image.ptr<Vec3b>(y) + left, firstRow + left, static_cast<size_t>(right - left) * 3);
+	}
+#pragma omp atomic
+	++leafQuantity;
+}
 
-		for (size_t i = startIdx; i < endIdx; ++i)
+// Compresses image with blocks whose size adapts to its detail: uniform regions become large blocks
+// and detailed ones are split down to QUADTREE_MIN_BLOCK_SIZE. integral must have been built with squares
+// from the same image. pixelGroupQuantity receives the number of blocks produced.
+Mat compressImageQuadtree(Mat image, const IntegralImage &integral, ImageCompressionVariance variance, size_t &pixelGroupQuantity, int threads, int cutoffDepth = QUADTREE_TASK_CUTOFF_DEPTH)
+{
+	double threshold = static_cast<double>(variance);
+	size_t leafQuantity = 0;
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+	{
+		for (unsigned int top = 0; top < integral.rows; top += QUADTREE_MAX_BLOCK_SIZE)
 		{
-			Vec3b average = getAverageFromPixelGroup(image, pixelGroups[i]);
-			for (size_t j = 0; j < pixelGroups[i].size(); ++j)
+			for (unsigned int left = 0; left < integral.columns; left += QUADTREE_MAX_BLOCK_SIZE)
 			{
-				unsigned int x = get<0>(pixelGroups[i][j]);
-				unsigned int y = get<1>(pixelGroups[i][j]);
-				image.at<Vec3b>(Point(x, y)) = average;
+#pragma omp task default(none) firstprivate(left, top, threshold, cutoffDepth) shared(image, integral, leafQuantity)
+				compressQuadtreeRegion(image, integral, left, top, QUADTREE_MAX_BLOCK_SIZE, threshold, 0, cutoffDepth, leafQuantity);
 			}
 		}
 	}
+	pixelGroupQuantity = leafQuantity;
 	return image;
 }
 
-void testCompression(string imagePath, string imageName, ImageCompressionRate rate, fstream &file, unsigned int maxThreads)
+// ------------------------------------------------------
+// Pyramid compression
+
+// Block sums of one pyramid level inside a band of rows, three channels per block.
+struct PyramidLevelSums
+{
+	unsigned int rows;
+	unsigned int columns;
+	vector<uint32_t> sums;
+};
+
+// Sums the 2x2 blocks of rows [top, bottom) of image.
+void sumFinestPyramidLevel(const Mat &image, unsigned int top, unsigned int bottom, PyramidLevelSums &level)
 {
-	Mat image = imread(imagePath);
-	int numberOfPixels = image.cols * image.rows;
+	level.rows = (bottom - top + 1) / 2;
+	level.columns = (image.cols + 1) / 2;
+	level.sums.assign(static_cast<size_t>(level.rows) * level.columns * 3, 0);
+	for (unsigned int y = top; y < bottom; ++y)
+	{
+		const uchar *row = image.ptr<uchar>(y);
+		uint32_t *sums = level.sums.data() + static_cast<size_t>((y - top) / 2) * level.columns * 3;
+		for (int x = 0; x < image.cols; ++x)
+		{
+			uint32_t *sum = sums + (x / 2) * 3;
+			sum[0] += row[x * 3];
+			sum[1] += row[x * 3 + 1];
+			sum[2] += row[x * 3 + 2];
+		}
+	}
+}
+
+// Sums every 2x2 group of blocks of finer into one block of coarser.
+void sumCoarserPyramidLevel(const PyramidLevelSums &finer, PyramidLevelSums &coarser)
+{
+	coarser.rows = (finer.rows + 1) / 2;
+	coarser.columns = (finer.columns + 1) / 2;
+	coarser.sums.assign(static_cast<size_t>(coarser.rows) * coarser.columns * 3, 0);
+	for (unsigned int i = 0; i < finer.rows; ++i)
+	{
+		const uint32_t *finerSums = finer.sums.data() + static_cast<size_t>(i) * finer.columns * 3;
+		uint32_t *coarserSums = coarser.sums.data() + static_cast<size_t>(i / 2) * coarser.columns * 3;
+		for (unsigned int j = 0; j < finer.columns; ++j)
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				coarserSums[(j / 2) * 3 + c] += finerSums[j * 3 + c];
+			}
+		}
+	}
+}
+
+// Stores the averages of level into the rows of grid starting at gridTop. The band covers rows [top, bottom)
+// of an image of columns pixels wide; blocks crossing the bottom or right edge are averaged over their clipped size.
+void storePyramidLevel(Mat &grid, unsigned int gridTop, unsigned int top, unsigned int bottom, unsigned int columns, unsigned int blockSize, const PyramidLevelSums &level)
+{
+	for (unsigned int i = 0; i < level.rows; ++i)
+	{
+		unsigned int blockTop = top + i * blockSize;
+		unsigned int blockHeight = min(blockTop + blockSize, bottom) - blockTop;
+		const uint32_t *sums = level.sums.data() + static_cast<size_t>(i) * level.columns * 3;
+		Vec3b *averages = grid.ptr<Vec3b>(gridTop + i);
+		for (unsigned int j = 0; j < level.columns; ++j)
+		{
+			unsigned int left = j * blockSize;
+			unsigned int pixelQuantity = blockHeight * (min(left + blockSize, columns) - left);
+			averages[j] = Vec3b(sums[j * 3] / pixelQuantity, sums[j * 3 + 1] / pixelQuantity, sums[j * 3 + 2] / pixelQuantity);
+		}
+	}
+}
+
+// Compresses image at every rate of AllImageCompressionRates in one pass. The image is split into
+// bands as tall as the largest block; each band sums its 2x2 blocks once and derives every coarser
+// level from the previous one, so each pixel is read a single time for all rates.
+// Returns one compressed image per rate, in the order of AllImageCompressionRates.
+vector<CompressedImage> compressImagePyramid(const Mat &image, vector<size_t> &pixelGroupQuantities, int threads)
+{
+	size_t levels = AllImageCompressionRates.size();
+	vector<CompressedImage> compressedImages(levels);
+	pixelGroupQuantities.resize(levels);
+	for (size_t level = 0; level < levels; ++level)
+	{
+		compressedImages[level] = createCompressedImage(image, AllImageCompressionRates[level]);
+		pixelGroupQuantities[level] = compressedImages[level].grid.total();
+	}
+
+	unsigned int bandHeight = static_cast<unsigned int>(AllImageCompressionRates.back());
+	int bands = (image.rows + bandHeight - 1) / bandHeight;
+#pragma omp parallel num_threads(threads)
+	{
+		vector<PyramidLevelSums> levelSums(levels);
+#pragma omp for schedule(static)
+		for (int band = 0; band < bands; ++band)
+		{
+			unsigned int top = band * bandHeight;
+			unsigned int bottom = min(top + bandHeight, static_cast<unsigned int>(image.rows));
+			sumFinestPyramidLevel(image, top, bottom, levelSums[0]);
+			for (size_t level = 1; level < levels; ++level)
+			{
+				sumCoarserPyramidLevel(levelSums[level - 1], levelSums[level]);
+			}
+			for (size_t level = 0; level < levels; ++level)
+			{
+				unsigned int blockSize = compressedImages[level].rate;
+				storePyramidLevel(compressedImages[level].grid, top / blockSize, top, bottom, image.cols, blockSize, levelSums[level]);
+			}
+		}
+	}
+	return compressedImages;
+}
+
+vector<string> getCompressionBenchmarkRow(const string &imagePath, const Mat &image, const string &compressionRate, size_t pixelGroupQuantity, size_t pixelGroupQuantityPerThread, unsigned int threads, const TimingStatistics &statistics, unsigned int tileSize, const string &backend)
+{
+	return {imagePath, to_string(image.cols) + "x" + to_string(image.rows), to_string(image.cols * image.rows), compressionRate, to_string(pixelGroupQuantity), to_string(pixelGroupQuantityPerThread), to_string(threads), formatBenchmarkNumber(statistics.median), to_string(tileSize), backend};
+}
+
+// Decoding the source is measured on its own, with imread() rather than the cache, so its cost is not folded into the kernels
+void testCompressionDecode(const string &imagePath, const Mat &image, BenchmarkReport &report, const BenchmarkConfig &config)
+{
+	cout << "Decoding image " << imagePath << endl;
+	TimingStatistics statistics = measure(config, [&imagePath]() { imread(imagePath); });
+	writeBenchmarkResult(report, getCompressionBenchmarkRow(imagePath, image, "none", 0, 0, 1, statistics, 0, "serial"), BenchmarkStage::DECODE, statistics);
+}
+
+void testCompression(string imagePath, string imageName, ImageCompressionRate rate, BenchmarkReport &report, const BenchmarkConfig &config, unsigned int tileSize)
+{
+	Mat image = readCachedImage(imagePath);
 	string compressionRate = parseImageCompressionRate(rate);
 	size_t pixelGroupQuantity = 0;
 	size_t pixelGroupQuantityPerThread = 0;
-	double startTime = 0.0;
-	double endTime = 0.0;
+	CompressedImage compressedImage;
 
 	cout << "Processing image " << imagePath << " with resolution " << image.cols << "x" << image.rows << " and compression rate " << compressionRate << " using 1 thread" << endl;
-	startTime = omp_get_wtime();
-	Mat compressedImage = compressImage(image.clone(), rate, pixelGroupQuantity);
-	endTime = omp_get_wtime();
-	file << imagePath << "," << image.cols << "x" << image.rows << "," << numberOfPixels << "," << compressionRate << "," << pixelGroupQuantity << "," << pixelGroupQuantity << "," << 1 << "," << endTime - startTime << endl;
+	TimingStatistics statistics = measure(config, [&]() { compressedImage = compressImageGrid(image, rate, pixelGroupQuantity); });
+	writeBenchmarkResult(report, getCompressionBenchmarkRow(imagePath, image, compressionRate, pixelGroupQuantity, pixelGroupQuantity, 1, statistics, 0, "serial"), BenchmarkStage::COMPUTE, statistics);
 
-	for (unsigned int threads = 2; threads <= maxThreads; threads += 2)
+	// Every thread count runs once per execution backend, so the results compare OpenMP with the thread pool
+	ExecutionBackend previousBackend = getExecutionBackend();
+	for (unsigned int threads : config.threadCounts)
 	{
-		cout << "Processing image " << imagePath << " with resolution " << image.cols << "x" << image.rows << " and compression rate " << compressionRate << " using " << threads << " threads" << endl;
-		startTime = omp_get_wtime();
-		Mat compressedImage = compressImageThreads(image.clone(), rate, pixelGroupQuantity, pixelGroupQuantityPerThread, threads);
-		endTime = omp_get_wtime();
-		saveImage(COMPRESSION_IMAGES_PATH_PROCESSED + imageName + "_" + to_string(threads) + "_" + compressionRate + ".tiff", compressedImage);
-		file << imagePath << "," << image.cols << "x" << image.rows << "," << numberOfPixels << "," << compressionRate << "," << pixelGroupQuantity << "," << pixelGroupQuantityPerThread << "," << threads << "," << endTime - startTime << endl;
+		for (ExecutionBackend backend : AllExecutionBackends)
+		{
+			setExecutionBackend(backend);
+			cout << "Processing image " << imagePath << " with resolution " << image.cols << "x" << image.rows << " and compression rate " << compressionRate << " using " << threads << " threads on " << parseExecutionBackend(backend) << endl;
+			statistics = measure(config, [&]() { compressedImage = compressImageGridThreads(image, rate, pixelGroupQuantity, pixelGroupQuantityPerThread, threads, tileSize); });
+			writeBenchmarkResult(report, getCompressionBenchmarkRow(imagePath, image, compressionRate, pixelGroupQuantity, pixelGroupQuantityPerThread, threads, statistics, tileSize, parseExecutionBackend(backend)), BenchmarkStage::COMPUTE, statistics);
+		}
 	}
+	setExecutionBackend(previousBackend);
+
+	// The result is written once, as its own stage, instead of after every timed run
+	string outputPath = COMPRESSION_IMAGES_PATH_PROCESSED + imageName + "_" + compressionRate + COMPRESSED_IMAGE_EXTENSION;
+	statistics = measure(config, [&]() { saveCompressedImage(outputPath, compressedImage); });
+	writeBenchmarkResult(report, getCompressionBenchmarkRow(imagePath, image, compressionRate, pixelGroupQuantity, pixelGroupQuantity, 1, statistics, 0, "serial"), BenchmarkStage::ENCODE, statistics);
 }
 
-void benchmark(unsigned int maxThreads)
+void testCompressionPyramid(string imagePath, string imageName, BenchmarkReport &report, const BenchmarkConfig &config)
 {
-	string const LARGE_SIZED_IMAGE = COMPRESSION_IMAGES_PATH + "img_01.tiff";
-	string const SMALL_SIZED_IMAGE = COMPRESSION_IMAGES_PATH + "img_05.tiff";
-	fstream file(BENCHMARK_RESULTS, ios::out | ios::trunc);
-	if (!file.is_open())
+	Mat image = readCachedImage(imagePath);
+	vector<size_t> pixelGroupQuantities;
+	vector<CompressedImage> compressedImages;
+
+	for (unsigned int threads : config.threadCounts)
+	{
+		cout << "Processing image " << imagePath << " with resolution " << image.cols << "x" << image.rows << " and every compression rate using " << threads << " threads" << endl;
+		TimingStatistics statistics = measure(config, [&]() { compressedImages = compressImagePyramid(image, pixelGroupQuantities, threads); });
+		size_t pixelGroupQuantity = accumulate(pixelGroupQuantities.begin(), pixelGroupQuantities.end(), static_cast<size_t>(0));
+		writeBenchmarkResult(report, getCompressionBenchmarkRow(imagePath, image, "pyramid", pixelGroupQuantity, pixelGroupQuantity / threads, threads, statistics, 0, "openmp"), BenchmarkStage::COMPUTE, statistics);
+	}
+	for (size_t level = 0; level < compressedImages.size(); ++level)
+	{
+		saveCompressedImage(COMPRESSION_IMAGES_PATH_PROCESSED + imageName + "_pyramid_" + parseImageCompressionRate(AllImageCompressionRates[level]) + COMPRESSED_IMAGE_EXTENSION, compressedImages[level]);
+	}
+}
+
+// img_01.tiff -> img_01
+string getImageName(const string &imagePath)
+{
+	size_t separator = imagePath.find_last_of('/');
+	string name = separator == string::npos ? imagePath : imagePath.substr(separator + 1);
+	return name.substr(0, name.find_last_of('.'));
+}
+
+void benchmark(const BenchmarkConfig &config, const vector<string> &imagePaths, unsigned int tileSize = DEFAULT_TILE_SIZE)
+{
+	BenchmarkReport report;
+	if (!openBenchmarkReport(report, BENCHMARK_RESULTS, BENCHMARK_COLUMNS))
 	{
 		cout << "Error opening file " << BENCHMARK_RESULTS << endl;
 		return;
 	}
-	file << BENCHMARK_COLUMNS << endl;
-	
-	testCompression(LARGE_SIZED_IMAGE, "img_01", ImageCompressionRate::LOW, file, maxThreads);
-	testCompression(LARGE_SIZED_IMAGE, "img_01", ImageCompressionRate::MEDIUM, file, maxThreads);
-	testCompression(LARGE_SIZED_IMAGE, "img_01", ImageCompressionRate::HIGH, file, maxThreads);
-	testCompression(LARGE_SIZED_IMAGE, "img_01", ImageCompressionRate::VERY_HIGH, file, maxThreads);
-
-	testCompression(SMALL_SIZED_IMAGE, "img_05", ImageCompressionRate::LOW, file, maxThreads);
-	testCompression(SMALL_SIZED_IMAGE, "img_05", ImageCompressionRate::MEDIUM, file, maxThreads);
-	testCompression(SMALL_SIZED_IMAGE, "img_05", ImageCompressionRate::HIGH, file, maxThreads);
-	testCompression(SMALL_SIZED_IMAGE, "img_05", ImageCompressionRate::VERY_HIGH, file, maxThreads);
-	file.close();
+
+	for (const string &imagePath : imagePaths)
+	{
+		Mat image = readCachedImage(imagePath);
+		if (image.empty())
+		{
+			cout << "Error reading image " << imagePath << endl;
+			continue;
+		}
+		testCompressionDecode(imagePath, image, report, config);
+		for (ImageCompressionRate rate : AllImageCompressionRates)
+		{
+			testCompression(imagePath, getImageName(imagePath), rate, report, config, tileSize);
+		}
+		testCompressionPyramid(imagePath, getImageName(imagePath), report, config);
+	}
+	closeBenchmarkReport(report);
+}
+
+void benchmark(unsigned int maxThreads, unsigned int tileSize = DEFAULT_TILE_SIZE)
+{
+	vector<string> imagePaths = {COMPRESSION_IMAGES_PATH + "img_01.tiff", COMPRESSION_IMAGES_PATH + "img_05.tiff"};
+	benchmark(createBenchmarkConfig(maxThreads), imagePaths, tileSize);
 }
 
 /*int main(int argc, char **argv)
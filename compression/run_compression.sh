@@ -1 +1 @@
-g++ -o compression compression.cpp -I/usr/include/opencv4 -lopencv_core -lopencv_imgcodecs -lopencv_highgui -lopencv_imgproc -lopencv_features2d -lopencv_calib3d -lopencv_videoio -std=c++11 -fopenmp && ./compression
+(cd ../kernels && sh build_kernels.sh) && g++ -o compression compression.cpp -L../kernels -limagekernels -I/usr/include/opencv4 -lopencv_core -lopencv_imgcodecs -lopencv_highgui -lopencv_imgproc -lopencv_features2d -lopencv_calib3d -lopencv_videoio -std=c++11 -O2 -fopenmp && ./compression
\ No newline at end of file
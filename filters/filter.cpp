@@ -1,49 +1,1084 @@
+#include <array>
+#include <cmath>
+#include <fstream>
 #include <iostream>
 #include <stdlib.h>
 #include <string>
 #include <opencv2/opencv.hpp>
 #include <omp.h>
 #include <vector>
+#include "../benchmark/benchmark.hpp"
+#include "../cache/image_cache.hpp"
+#include "../kernels/kernels.hpp"
+#include "../parallel/execution.hpp"
 
 using namespace std;
 using namespace cv;
 
+// ------------------------------------------------------
+// Motor de operaciones puntuales
+
+/*
+Una operación puntual cambia cada canal de cada píxel usando solo su propio valor, por lo que cualquier
+cadena de operaciones puntuales se reduce a una tabla de 256 entradas (LUT) que se calcula una sola vez.
+Aplicar la tabla cuesta una lectura y una escritura por byte, sin aritmética de punto flotante.
+*/
+enum class PointOperationType
+{
+	CONTRAST,
+	BRIGHTNESS,
+	GAMMA,
+	INVERT,
+	THRESHOLD,
+	LEVELS
+};
+
+struct PointOperation
+{
+	PointOperationType type;
+	double first;
+	double second;
+	double third;
+};
+
+typedef array<uchar, 256> LookupTable;
+
+PointOperation contrastOperation(double contrastValue)
+{
+	PointOperation operation = {PointOperationType::CONTRAST, contrastValue, 0.0, 0.0};
+	return operation;
+}
+
+PointOperation brightnessOperation(double brightnessValue)
+{
+	PointOperation operation = {PointOperationType::BRIGHTNESS, brightnessValue, 0.0, 0.0};
+	return operation;
+}
+
+PointOperation gammaOperation(double gammaValue)
+{
+	PointOperation operation = {PointOperationType::GAMMA, gammaValue, 0.0, 0.0};
+	return operation;
+}
+
+PointOperation invertOperation()
+{
+	PointOperation operation = {PointOperationType::INVERT, 0.0, 0.0, 0.0};
+	return operation;
+}
+
+PointOperation thresholdOperation(double thresholdValue)
+{
+	PointOperation operation = {PointOperationType::THRESHOLD, thresholdValue, 0.0, 0.0};
+	return operation;
+}
+
+PointOperation levelsOperation(double inputBlack, double inputWhite, double gammaValue)
+{
+	PointOperation operation = {PointOperationType::LEVELS, inputBlack, inputWhite, gammaValue};
+	return operation;
+}
+
+// Evalúa la fórmula de la operación para un valor de canal
+uchar evaluatePointOperation(const PointOperation& operation, int value)
+{
+	switch (operation.type)
+	{
+	case PointOperationType::CONTRAST:
+		return saturate_cast<uchar>(operation.first * (value - 128) + 128);
+	case PointOperationType::BRIGHTNESS:
+		return saturate_cast<uchar>(value + operation.first);
+	case PointOperationType::GAMMA:
+		return saturate_cast<uchar>(255.0 * pow(value / 255.0, 1.0 / operation.first));
+	case PointOperationType::INVERT:
+		return static_cast<uchar>(255 - value);
+	case PointOperationType::THRESHOLD:
+		return value >= operation.first ? 255 : 0;
+	case PointOperationType::LEVELS:
+	{
+		double normalized = (value - operation.first) / max(operation.second - operation.first, 1.0);
+		normalized = min(max(normalized, 0.0), 1.0);
+		return saturate_cast<uchar>(255.0 * pow(normalized, 1.0 / operation.third));
+	}
+	default:
+		return static_cast<uchar>(value);
+	}
+}
+
+// Compone las operaciones, en orden, en una sola tabla
+LookupTable buildLookupTable(const vector<PointOperation>& operations)
+{
+	LookupTable table;
+	for (int value = 0; value < 256; ++value)
+	{
+		uchar result = static_cast<uchar>(value);
+		for (size_t i = 0; i < operations.size(); ++i)
+		{
+			result = evaluatePointOperation(operations[i], result);
+		}
+		table[value] = result;
+	}
+	return table;
+}
+
+/*
+Coeficientes de la interpolación bilineal en punto fijo: para cada columna y fila de salida, la posición de
+origen y el peso de la siguiente, escalado a RESIZE_WEIGHT_SCALE. Se usa la misma convención de centros de
+píxel que resize() con INTER_LINEAR.
+*/
+const int RESIZE_WEIGHT_BITS = 11;
+const int RESIZE_WEIGHT_SCALE = 1 << RESIZE_WEIGHT_BITS;
+
+struct ResizeMap
+{
+	vector<int> sourceColumns;
+	vector<int> columnWeights;
+	vector<int> sourceRows;
+	vector<int> rowWeights;
+};
+
+void computeResizeCoordinates(int sourceSize, int targetSize, vector<int>& sourcePositions, vector<int>& nextWeights)
+{
+	double scale = static_cast<double>(sourceSize) / targetSize;
+	sourcePositions.resize(targetSize);
+	nextWeights.resize(targetSize);
+	for (int i = 0; i < targetSize; ++i)
+	{
+		double position = (i + 0.5) * scale - 0.5;
+		int sourcePosition = static_cast<int>(floor(position));
+		double fraction = position - sourcePosition;
+		if (sourcePosition < 0)
+		{
+			sourcePosition = 0;
+			fraction = 0.0;
+		}
+		if (sourcePosition >= sourceSize - 1)
+		{
+			sourcePosition = sourceSize - 1;
+			fraction = 0.0;
+		}
+		sourcePositions[i] = sourcePosition;
+		nextWeights[i] = static_cast<int>(fraction * RESIZE_WEIGHT_SCALE + 0.5);
+	}
+}
+
+ResizeMap computeResizeMap(const Mat& inputImage, int targetWidth, int targetHeight)
+{
+	ResizeMap resizeMap;
+	computeResizeCoordinates(inputImage.cols, targetWidth, resizeMap.sourceColumns, resizeMap.columnWeights);
+	computeResizeCoordinates(inputImage.rows, targetHeight, resizeMap.sourceRows, resizeMap.rowWeights);
+	return resizeMap;
+}
+
+// Interpola la fila y de la imagen redimensionada desde dos filas de entrada y le aplica la tabla antes de escribirla
+void resizeRow(const Mat& inputImage, const ResizeMap& resizeMap, int y, uchar* outputRow, const LookupTable& table)
+{
+	int channels = inputImage.channels();
+	int targetWidth = resizeMap.sourceColumns.size();
+	int lastColumn = inputImage.cols - 1;
+	const uchar* topRow = inputImage.ptr<uchar>(resizeMap.sourceRows[y]);
+	const uchar* bottomRow = inputImage.ptr<uchar>(min(resizeMap.sourceRows[y] + 1, inputImage.rows - 1));
+	int bottomWeight = resizeMap.rowWeights[y];
+	int topWeight = RESIZE_WEIGHT_SCALE - bottomWeight;
+	for (int x = 0; x < targetWidth; ++x)
+	{
+		int left = resizeMap.sourceColumns[x] * channels;
+		int right = min(resizeMap.sourceColumns[x] + 1, lastColumn) * channels;
+		int rightWeight = resizeMap.columnWeights[x];
+		int leftWeight = RESIZE_WEIGHT_SCALE - rightWeight;
+		for (int c = 0; c < channels; ++c)
+		{
+			int top = topRow[left + c] * leftWeight + topRow[right + c] * rightWeight;
+			int bottom = bottomRow[left + c] * leftWeight + bottomRow[right + c] * rightWeight;
+			int value = (top * topWeight + bottom * bottomWeight + (1 << (2 * RESIZE_WEIGHT_BITS - 1))) >> (2 * RESIZE_WEIGHT_BITS);
+			outputRow[x * channels + c] = table[value];
+		}
+	}
+}
+
+/*
+Redimensiona la imagen (interpolación bilineal) y le aplica la tabla en una sola pasada: cada fila de salida se
+interpola desde dos filas de entrada y pasa por la tabla antes de escribirse, sin imagen intermedia.
+Si las dimensiones no cambian, la pasada se reduce a aplicar la tabla. Las filas se reparten con parallelFor, sobre
+OpenMP o sobre el pool de hilos según el backend elegido, con tantos hilos como omp_get_max_threads().
+*/
+Mat applyLookupTable(const Mat& inputImage, const LookupTable& table, int targetWidth, int targetHeight)
+{
+	Mat outputImage(targetHeight, targetWidth, inputImage.type());
+	if (targetWidth == inputImage.cols && targetHeight == inputImage.rows)
+	{
+		parallelFor(0, outputImage.rows, omp_get_max_threads(), [&](int begin, int end, int worker) {
+			for (int y = begin; y < end; ++y)
+			{
+				applyLookupTableRow(inputImage.ptr<uchar>(y), outputImage.ptr<uchar>(y), static_cast<size_t>(targetWidth) * inputImage.channels(), table.data());
+			}
+			addTraceWork(static_cast<uint64_t>(end - begin) * targetWidth * inputImage.channels());
+		});
+		return outputImage;
+	}
+
+	ResizeMap resizeMap = computeResizeMap(inputImage, targetWidth, targetHeight);
+	parallelFor(0, targetHeight, omp_get_max_threads(), [&](int begin, int end, int worker) {
+		for (int y = begin; y < end; ++y)
+		{
+			resizeRow(inputImage, resizeMap, y, outputImage.ptr<uchar>(y), table);
+		}
+		addTraceWork(static_cast<uint64_t>(end - begin) * targetWidth * inputImage.channels());
+	});
+	return outputImage;
+}
+
+Mat applyPointOperations(const Mat& inputImage, const vector<PointOperation>& operations, int targetWidth, int targetHeight)
+{
+	return applyLookupTable(inputImage, buildLookupTable(operations), targetWidth, targetHeight);
+}
+
 /*
 La función applyContrast() recibe una imagen de entrada, un valor de contraste y las dimensiones de la imagen de salida.
-#pragma omp parallel for: Esta directiva indica al compilador que debe aplicar el paralelismo en el bucle for externo que itera sobre las filas de la imagen de salida.
-Cada hilo creado por OpenMP se encarga de un rango diferente de filas, dividiendo así la carga de trabajo entre múltiples hilos y aprovechando la capacidad de procesamiento multicore.
-Dentro de este bucle paralelo, se realiza el procesamiento de píxeles de forma similar a la versión no paralelizada. Cada hilo manipula un conjunto de píxeles independientes,
-lo que acelera significativamente el procesamiento en comparación con un enfoque secuencial.
+La fórmula de contraste se evalúa una sola vez por cada uno de los 256 valores posibles de un canal y se guarda en una tabla;
+el redimensionamiento y la aplicación de la tabla se hacen en la misma pasada sobre la imagen, repartiendo las filas de
+salida entre los hilos con OpenMP.
 El resultado es una imagen con contraste aplicado, que se devuelve como salida de la función.
 */
 Mat applyContrast(const Mat& inputImage, double contrastValue, int targetWidth, int targetHeight)
 {
-	Mat outputImage;
-	resize(inputImage, outputImage, Size(targetWidth, targetHeight));// Redimensionar la imagen de entrada a las dimensiones de salida especificadas
+	TraceRegion trace("applyContrast", omp_get_max_threads());
+	return applyPointOperations(inputImage, vector<PointOperation>(1, contrastOperation(contrastValue)), targetWidth, targetHeight);
+}
+
+// ------------------------------------------------------
+// Contraste automático
+
+/*
+En lugar de un valor de contraste elegido a mano, el modo automático calcula el histograma de cada canal y deriva
+de él una tabla: STRETCH estira el rango que ocupa la imagen (descartando AUTO_CONTRAST_CLIP de cada extremo) a
+[0, 255], y EQUALIZE ecualiza el histograma con su función de distribución acumulada.
+El histograma se calcula en paralelo: cada hilo cuenta en sus propios contadores y al final se suman una sola vez,
+sin operaciones atómicas sobre contadores compartidos.
+*/
+enum class AutoContrastMode
+{
+	STRETCH,
+	EQUALIZE
+};
+
+const double AUTO_CONTRAST_CLIP = 0.005;
+
+// 256 contadores por canal, uno detrás de otro
+struct ChannelHistograms
+{
+	int channels;
+	size_t pixels;
+	vector<size_t> bins;
+};
+
+// Histograma conjunto de todas las imágenes, que deben tener el mismo número de canales
+ChannelHistograms computeChannelHistograms(const vector<Mat>& images, int threads)
+{
+	ChannelHistograms histograms;
+	histograms.channels = images.empty() ? 0 : images[0].channels();
+	histograms.pixels = 0;
+	histograms.bins.assign(static_cast<size_t>(histograms.channels) * 256, 0);
+	vector<pair<size_t, int> > rows;
+	for (size_t i = 0; i < images.size(); ++i)
+	{
+		histograms.pixels += images[i].total();
+		for (int y = 0; y < images[i].rows; ++y)
+		{
+			rows.push_back(make_pair(i, y));
+		}
+	}
+	int channels = histograms.channels;
+	int rowQuantity = rows.size();
+
+#pragma omp parallel num_threads(threads)
+	{
+		vector<size_t> privateBins(static_cast<size_t>(channels) * 256, 0);
+#pragma omp for schedule(static)
+		for (int i = 0; i < rowQuantity; ++i)
+		{
+			const Mat& image = images[rows[i].first];
+			const uchar* row = image.ptr<uchar>(rows[i].second);
+			for (int x = 0; x < image.cols; ++x)
+			{
+				for (int c = 0; c < channels; ++c)
+				{
+					++privateBins[c * 256 + row[x * channels + c]];
+				}
+			}
+		}
+#pragma omp critical
+		for (size_t i = 0; i < privateBins.size(); ++i)
+		{
+			histograms.bins[i] += privateBins[i];
+		}
+	}
+	return histograms;
+}
+
+vector<LookupTable> buildAutoContrastTables(const ChannelHistograms& histograms, AutoContrastMode mode)
+{
+	vector<LookupTable> tables(histograms.channels);
+	for (int c = 0; c < histograms.channels; ++c)
+	{
+		const size_t* bins = histograms.bins.data() + c * 256;
+		if (mode == AutoContrastMode::EQUALIZE)
+		{
+			size_t cumulative = 0;
+			size_t firstCount = 0;
+			for (int value = 0; value < 256 && firstCount == 0; ++value)
+			{
+				firstCount = bins[value];
+			}
+			double range = max(static_cast<double>(histograms.pixels - firstCount), 1.0);
+			for (int value = 0; value < 256; ++value)
+			{
+				cumulative += bins[value];
+				tables[c][value] = saturate_cast<uchar>(cumulative > firstCount ? (cumulative - firstCount) * 255.0 / range : 0.0);
+			}
+			continue;
+		}
+
+		size_t clipped = static_cast<size_t>(histograms.pixels * AUTO_CONTRAST_CLIP);
+		int low = 0, high = 255;
+		size_t count = 0;
+		while (low < 255 && count + bins[low] <= clipped)
+		{
+			count += bins[low++];
+		}
+		count = 0;
+		while (high > low && count + bins[high] <= clipped)
+		{
+			count += bins[high--];
+		}
+		double scale = high > low ? 255.0 / (high - low) : 1.0;
+		for (int value = 0; value < 256; ++value)
+		{
+			tables[c][value] = saturate_cast<uchar>((value - low) * scale);
+		}
+	}
+	return tables;
+}
+
+// Aplica una tabla distinta a cada canal de la imagen
+Mat applyChannelLookupTables(const Mat& inputImage, const vector<LookupTable>& tables, int threads)
+{
+	Mat outputImage(inputImage.rows, inputImage.cols, inputImage.type());
+	int channels = inputImage.channels();
+#pragma omp parallel for num_threads(threads)
+	for (int y = 0; y < inputImage.rows; ++y)
+	{
+		const uchar* inputRow = inputImage.ptr<uchar>(y);
+		uchar* outputRow = outputImage.ptr<uchar>(y);
+		for (int x = 0; x < inputImage.cols; ++x)
+		{
+			for (int c = 0; c < channels; ++c)
+			{
+				outputRow[x * channels + c] = tables[c][inputRow[x * channels + c]];
+			}
+		}
+	}
+	return outputImage;
+}
+
+// Ajusta un lote de cuadros con un solo histograma compartido, para que todos reciban la misma corrección
+vector<Mat> applyAutoContrast(const vector<Mat>& frames, AutoContrastMode mode, int threads)
+{
+	vector<LookupTable> tables = buildAutoContrastTables(computeChannelHistograms(frames, threads), mode);
+	vector<Mat> outputFrames;
+	for (size_t i = 0; i < frames.size(); ++i)
+	{
+		outputFrames.push_back(applyChannelLookupTables(frames[i], tables, threads));
+	}
+	return outputFrames;
+}
+
+Mat applyAutoContrast(const Mat& inputImage, AutoContrastMode mode, int threads)
+{
+	return applyAutoContrast(vector<Mat>(1, inputImage), mode, threads)[0];
+}
+
+// ------------------------------------------------------
+// Cadenas de filtros
+
+/*
+Una cadena de filtros es una lista ordenada de etapas (por ejemplo redimensionar, contraste, escala de grises,
+desenfoque y realce). Antes de ejecutarla, las operaciones puntuales consecutivas se componen en una sola tabla
+y la cadena se divide en pasadas: solo un cambio de tamaño obliga a materializar una imagen intermedia.
+Cada pasada recorre la imagen por franjas de FILTER_STRIP_HEIGHT filas; las etapas de vecindad leen una fila extra
+por arriba y por abajo (el halo), así que cada franja atraviesa todas las etapas en buffers del hilo que caben en L2.
+*/
+enum class FilterStageType
+{
+	RESIZE,
+	POINT,
+	GRAYSCALE,
+	KERNEL
+};
+
+// Núcleo 3x3 de enteros; el resultado se divide por divisor y se satura a [0, 255]. Los bordes replican el píxel más cercano.
+struct FilterKernel
+{
+	int weights[3][3];
+	int divisor;
+};
+
+struct FilterStage
+{
+	FilterStageType type;
+	int targetWidth;
+	int targetHeight;
+	PointOperation operation;
+	FilterKernel kernel;
+};
+
+const int FILTER_STRIP_HEIGHT = 32;
+const FilterKernel BLUR_KERNEL = {{{1, 1, 1}, {1, 1, 1}, {1, 1, 1}}, 9};
+const FilterKernel SHARPEN_KERNEL = {{{0, -1, 0}, {-1, 5, -1}, {0, -1, 0}}, 1};
+
+FilterStage resizeStage(int targetWidth, int targetHeight)
+{
+	FilterStage stage = FilterStage();
+	stage.type = FilterStageType::RESIZE;
+	stage.targetWidth = targetWidth;
+	stage.targetHeight = targetHeight;
+	return stage;
+}
+
+FilterStage pointStage(const PointOperation& operation)
+{
+	FilterStage stage = FilterStage();
+	stage.type = FilterStageType::POINT;
+	stage.operation = operation;
+	return stage;
+}
+
+FilterStage grayscaleStage()
+{
+	FilterStage stage = FilterStage();
+	stage.type = FilterStageType::GRAYSCALE;
+	return stage;
+}
+
+FilterStage kernelStage(const FilterKernel& kernel)
+{
+	FilterStage stage = FilterStage();
+	stage.type = FilterStageType::KERNEL;
+	stage.kernel = kernel;
+	return stage;
+}
+
+FilterStage blurStage()
+{
+	return kernelStage(BLUR_KERNEL);
+}
+
+FilterStage sharpenStage()
+{
+	return kernelStage(SHARPEN_KERNEL);
+}
+
+// Paso de una pasada ya compilada: una tabla (varias operaciones puntuales compuestas), escala de grises o un núcleo
+struct FilterStep
+{
+	FilterStageType type;
+	LookupTable table;
+	FilterKernel kernel;
+};
+
+// Una pasada lee su imagen de entrada, opcionalmente la redimensiona (aplicando fetchTable al leer) y ejecuta sus pasos por franjas
+struct FilterPass
+{
+	bool resizes;
+	int targetWidth;
+	int targetHeight;
+	LookupTable fetchTable;
+	vector<FilterStep> steps;
+};
+
+LookupTable identityLookupTable()
+{
+	return buildLookupTable(vector<PointOperation>());
+}
+
+vector<FilterPass> compileFilterChain(const vector<FilterStage>& chain)
+{
+	vector<FilterPass> passes(1);
+	passes.back().resizes = false;
+	passes.back().fetchTable = identityLookupTable();
+	vector<PointOperation> pendingOperations;
+	for (size_t i = 0; i <= chain.size(); ++i)
+	{
+		bool isPoint = i < chain.size() && chain[i].type == FilterStageType::POINT;
+		if (isPoint)
+		{
+			pendingOperations.push_back(chain[i].operation);
+			continue;
+		}
+		if (!pendingOperations.empty())
+		{
+			FilterPass& pass = passes.back();
+			// Justo después de un cambio de tamaño, la tabla se aplica al interpolar
+			if (pass.resizes && pass.steps.empty())
+			{
+				pass.fetchTable = buildLookupTable(pendingOperations);
+			}
+			else
+			{
+				FilterStep step = FilterStep();
+				step.type = FilterStageType::POINT;
+				step.table = buildLookupTable(pendingOperations);
+				pass.steps.push_back(step);
+			}
+			pendingOperations.clear();
+		}
+		if (i == chain.size())
+		{
+			break;
+		}
+		if (chain[i].type == FilterStageType::RESIZE)
+		{
+			if (passes.back().resizes || !passes.back().steps.empty())
+			{
+				passes.push_back(FilterPass());
+			}
+			passes.back().resizes = true;
+			passes.back().targetWidth = chain[i].targetWidth;
+			passes.back().targetHeight = chain[i].targetHeight;
+			passes.back().fetchTable = identityLookupTable();
+		}
+		else
+		{
+			FilterStep step = FilterStep();
+			step.type = chain[i].type;
+			step.kernel = chain[i].kernel;
+			passes.back().steps.push_back(step);
+		}
+	}
+	return passes;
+}
+
+// Convierte a gris una fila BGR manteniendo los tres canales (pesos BT.601 en punto fijo)
+void grayscaleRow(uchar* row, int columns)
+{
+	for (int x = 0; x < columns; ++x)
+	{
+		uchar* pixel = row + x * 3;
+		uchar gray = static_cast<uchar>((pixel[0] * 29 + pixel[1] * 150 + pixel[2] * 77 + 128) >> 8);
+		pixel[0] = gray;
+		pixel[1] = gray;
+		pixel[2] = gray;
+	}
+}
+
+// Calcula una fila de salida del núcleo a partir de las filas de entrada de arriba, del centro y de abajo
+void kernelRow(const uchar* above, const uchar* center, const uchar* below, uchar* outputRow, int columns, int channels, const FilterKernel& kernel)
+{
+	const uchar* rows[3] = {above, center, below};
+	int half = kernel.divisor / 2;
+	for (int x = 0; x < columns; ++x)
+	{
+		int neighbors[3] = {max(x - 1, 0) * channels, x * channels, min(x + 1, columns - 1) * channels};
+		for (int c = 0; c < channels; ++c)
+		{
+			int sum = 0;
+			for (int i = 0; i < 3; ++i)
+			{
+				for (int j = 0; j < 3; ++j)
+				{
+					sum += kernel.weights[i][j] * rows[i][neighbors[j] + c];
+				}
+			}
+			int value = sum >= 0 ? (sum + half) / kernel.divisor : -((half - sum) / kernel.divisor);
+			outputRow[x * channels + c] = static_cast<uchar>(min(max(value, 0), 255));
+		}
+	}
+}
+
+// Filas [start, end) de una etapa intermedia guardadas en un buffer del hilo
+struct FilterStrip
+{
+	int start;
+	int end;
+	vector<uchar> data;
+};
+
+// Ejecuta una pasada sobre las filas [top, bottom) de la salida usando los buffers del hilo
+void runFilterPassStrip(const Mat& inputImage, const FilterPass& pass, const ResizeMap& resizeMap, Mat& outputImage, int top, int bottom, FilterStrip buffers[2])
+{
+	int columns = outputImage.cols;
+	int rows = outputImage.rows;
+	int channels = outputImage.channels();
+	size_t rowLength = static_cast<size_t>(columns) * channels;
+
+	// Filas que necesita cada paso, de atrás hacia adelante: un núcleo agrega una fila de halo por lado
+	int start = top, end = bottom;
+	for (size_t i = pass.steps.size(); i-- > 0;)
+	{
+		if (pass.steps[i].type == FilterStageType::KERNEL)
+		{
+			start = max(start - 1, 0);
+			end = min(end + 1, rows);
+		}
+	}
+
+	FilterStrip* current = &buffers[0];
+	FilterStrip* next = &buffers[1];
+	current->start = start;
+	current->end = end;
+	current->data.resize(static_cast<size_t>(end - start) * rowLength);
+	for (int y = start; y < end; ++y)
+	{
+		uchar* row = current->data.data() + (y - start) * rowLength;
+		if (pass.resizes)
+		{
+			resizeRow(inputImage, resizeMap, y, row, pass.fetchTable);
+		}
+		else
+		{
+			memcpy(row, inputImage.ptr<uchar>(y), rowLength);
+		}
+	}
+
+	for (size_t i = 0; i < pass.steps.size(); ++i)
+	{
+		const FilterStep& step = pass.steps[i];
+		if (step.type == FilterStageType::POINT)
+		{
+			applyLookupTableRow(current->data.data(), current->data.data(), current->data.size(), step.table.data());
+		}
+		else if (step.type == FilterStageType::GRAYSCALE)
+		{
+			if (channels == 3)
+			{
+				for (int y = current->start; y < current->end; ++y)
+				{
+					grayscaleRow(current->data.data() + (y - current->start) * rowLength, columns);
+				}
+			}
+		}
+		else
+		{
+			// El halo se consume: la salida del núcleo cubre las filas que todavía necesitan los pasos siguientes
+			int remainingKernels = 0;
+			for (size_t j = i + 1; j < pass.steps.size(); ++j)
+			{
+				remainingKernels += pass.steps[j].type == FilterStageType::KERNEL;
+			}
+			next->start = max(top - remainingKernels, 0);
+			next->end = min(bottom + remainingKernels, rows);
+			next->data.resize(static_cast<size_t>(next->end - next->start) * rowLength);
+			for (int y = next->start; y < next->end; ++y)
+			{
+				const uchar* above = current->data.data() + (max(y - 1, 0) - current->start) * rowLength;
+				const uchar* center = current->data.data() + (y - current->start) * rowLength;
+				const uchar* below = current->data.data() + (min(y + 1, rows - 1) - current->start) * rowLength;
+				kernelRow(above, center, below, next->data.data() + (y - next->start) * rowLength, columns, channels, step.kernel);
+			}
+			swap(current, next);
+		}
+	}
+
+	for (int y = top; y < bottom; ++y)
+	{
+		memcpy(outputImage.ptr<uchar>(y), current->data.data() + (y - current->start) * rowLength, rowLength);
+	}
+}
 
-#pragma omp parallel for // Aplicar paralelismo en el bucle for externo que itera sobre las filas de la imagen de salida
-	for (int y = 0; y < outputImage.rows; ++y)// Iterar sobre las filas de la imagen de salida
+Mat applyFilterChain(const Mat& inputImage, const vector<FilterStage>& chain)
+{
+	vector<FilterPass> passes = compileFilterChain(chain);
+	Mat image = inputImage;
+	for (size_t i = 0; i < passes.size(); ++i)
 	{
-		for (int x = 0; x < outputImage.cols; ++x)// Iterar sobre las columnas de la imagen de salida
+		const FilterPass& pass = passes[i];
+		int targetWidth = pass.resizes ? pass.targetWidth : image.cols;
+		int targetHeight = pass.resizes ? pass.targetHeight : image.rows;
+		ResizeMap resizeMap;
+		if (pass.resizes)
+		{
+			resizeMap = computeResizeMap(image, targetWidth, targetHeight);
+		}
+		Mat outputImage(targetHeight, targetWidth, image.type());
+		int strips = (targetHeight + FILTER_STRIP_HEIGHT - 1) / FILTER_STRIP_HEIGHT;
+#pragma omp parallel
 		{
-			for (int c = 0; c < outputImage.channels(); ++c)// Iterar sobre los canales de color (BGR)
+			FilterStrip buffers[2];
+#pragma omp for schedule(dynamic)
+			for (int strip = 0; strip < strips; ++strip)
 			{
-				outputImage.at<Vec3b>(y, x)[c] = saturate_cast<uchar>(
-					contrastValue * (outputImage.at<Vec3b>(y, x)[c] - 128) + 128// Aplicar el valor de contraste a cada píxel, utilizando la fórmula de ajuste de contraste
-				);
+				int top = strip * FILTER_STRIP_HEIGHT;
+				runFilterPassStrip(image, pass, resizeMap, outputImage, top, min(top + FILTER_STRIP_HEIGHT, targetHeight), buffers);
 			}
 		}
+		image = outputImage;
+	}
+	return image;
+}
+
+// ------------------------------------------------------
+// Convolución separable
+
+/*
+Un núcleo separable se aplica como una pasada horizontal seguida de una vertical, con costo proporcional a su
+ancho en lugar de a su área. La imagen se procesa por franjas de filas repartidas entre los hilos: cada hilo
+filtra horizontalmente las filas de su franja más el radio del núcleo por arriba y por abajo en un buffer de punto
+flotante propio, y la pasada vertical lee de ese buffer.
+La altura de la franja sale del ancho de la fila y del radio: se eligen tantas filas como quepan, junto con los
+resultados de cada núcleo, en CONVOLUTION_CACHE_BUDGET bytes, para que la pasada vertical las lea desde la caché L2.
+Con filas muy anchas no caben ni unas pocas, y la altura queda en el mínimo de CONVOLUTION_MIN_STRIP_RADII radios
+(nunca menos de CONVOLUTION_MIN_STRIP_HEIGHT filas), que limita las filas de borde recalculadas a la mitad de la franja;
+en ese caso el buffer ya no cabe en L2.
+Los bucles internos recorren valores contiguos de la fila con accumulateWeightedRow(), de la biblioteca de núcleos,
+que usa la variante vectorial que admita el procesador.
+Los bordes se reflejan sin repetir el píxel del borde, igual que BORDER_REFLECT_101 (el predeterminado de GaussianBlur).
+*/
+const size_t CONVOLUTION_CACHE_BUDGET = 256 * 1024;
+const int CONVOLUTION_MIN_STRIP_HEIGHT = 16;
+const int CONVOLUTION_MIN_STRIP_RADII = 4;
+const string FILTERS_BENCHMARK_COLUMNS = "image,resolution,number_of_pixels,filter,implementation,threads,strip_height,time,max_difference";
+const string FILTERS_BENCHMARK_RESULTS = "filters_results.csv";
+
+struct SeparableKernel
+{
+	vector<float> horizontal;
+	vector<float> vertical;
+};
+
+// Forma de combinar los resultados de los núcleos en el píxel de salida
+enum class ConvolutionCombine
+{
+	FIRST,
+	UNSHARP_MASK,
+	GRADIENT_MAGNITUDE,
+	ABSOLUTE_SUM
+};
+
+// Buffers de un hilo: una fila con bordes y las filas filtradas horizontalmente de la franja, un bloque por núcleo
+struct ConvolutionBuffers
+{
+	vector<float> paddedRow;
+	vector<float> horizontalRows;
+	vector<float> results;
+};
+
+vector<float> gaussianKernelWeights(double sigma)
+{
+	int radius = max(1, static_cast<int>(ceil(3.0 * sigma)));
+	vector<float> weights(2 * radius + 1);
+	double sum = 0.0;
+	for (int i = -radius; i <= radius; ++i)
+	{
+		weights[i + radius] = static_cast<float>(exp(-(i * i) / (2.0 * sigma * sigma)));
+		sum += weights[i + radius];
+	}
+	for (size_t i = 0; i < weights.size(); ++i)
+	{
+		weights[i] = static_cast<float>(weights[i] / sum);
+	}
+	return weights;
+}
+
+SeparableKernel gaussianKernel(double sigma)
+{
+	SeparableKernel kernel;
+	kernel.horizontal = gaussianKernelWeights(sigma);
+	kernel.vertical = kernel.horizontal;
+	return kernel;
+}
+
+SeparableKernel boxKernel(int radius)
+{
+	SeparableKernel kernel;
+	kernel.horizontal.assign(2 * radius + 1, 1.0f / (2 * radius + 1));
+	kernel.vertical = kernel.horizontal;
+	return kernel;
+}
+
+SeparableKernel separableKernel(const float* horizontal, const float* vertical)
+{
+	SeparableKernel kernel;
+	kernel.horizontal.assign(horizontal, horizontal + 3);
+	kernel.vertical.assign(vertical, vertical + 3);
+	return kernel;
+}
+
+int reflectIndex(int index, int size)
+{
+	if (size == 1)
+	{
+		return 0;
+	}
+	while (index < 0 || index >= size)
+	{
+		index = index < 0 ? -index : 2 * size - 2 - index;
+	}
+	return index;
+}
+
+// Núcleos de Sobel: derivada en x suavizada en y, y derivada en y suavizada en x
+vector<SeparableKernel> sobelKernels()
+{
+	const float derivative[3] = {-1.0f, 0.0f, 1.0f};
+	const float smoothing[3] = {1.0f, 2.0f, 1.0f};
+	vector<SeparableKernel> kernels;
+	kernels.push_back(separableKernel(derivative, smoothing));
+	kernels.push_back(separableKernel(smoothing, derivative));
+	return kernels;
+}
+
+// Núcleos del laplaciano: segunda derivada en x y segunda derivada en y
+vector<SeparableKernel> laplacianKernels()
+{
+	const float secondDerivative[3] = {1.0f, -2.0f, 1.0f};
+	const float identity[3] = {0.0f, 1.0f, 0.0f};
+	vector<SeparableKernel> kernels;
+	kernels.push_back(separableKernel(secondDerivative, identity));
+	kernels.push_back(separableKernel(identity, secondDerivative));
+	return kernels;
+}
+
+/*
+Filas por franja para una imagen de rows filas de length valores: las filas filtradas horizontalmente de la franja,
+con el radio por arriba y por abajo, y los resultados de cada núcleo deben caber en CONVOLUTION_CACHE_BUDGET bytes.
+*/
+int getConvolutionStripHeight(int rows, int length, const vector<SeparableKernel>& kernels)
+{
+	int radius = 0;
+	for (const SeparableKernel& kernel : kernels)
+	{
+		radius = max(radius, static_cast<int>(kernel.vertical.size() / 2));
+	}
+	size_t rowBytes = max(static_cast<size_t>(length), static_cast<size_t>(1)) * sizeof(float);
+	int budgetRows = static_cast<int>(min(CONVOLUTION_CACHE_BUDGET / rowBytes, static_cast<size_t>(rows) + 2 * radius));
+	int stripHeight = (budgetRows - 2 * radius) / static_cast<int>(1 + kernels.size());
+	stripHeight = max(stripHeight, max(CONVOLUTION_MIN_STRIP_HEIGHT, CONVOLUTION_MIN_STRIP_RADII * radius));
+	return max(1, min(stripHeight, rows));
+}
+
+// Filtra horizontalmente una fila de entrada; output tiene columns * channels valores
+void convolveRowHorizontal(const uchar* row, int columns, int channels, const vector<float>& weights, vector<float>& paddedRow, float* output)
+{
+	int radius = weights.size() / 2;
+	int length = columns * channels;
+	paddedRow.resize(static_cast<size_t>(columns + 2 * radius) * channels);
+	for (int x = -radius; x < columns + radius; ++x)
+	{
+		const uchar* pixel = row + reflectIndex(x, columns) * channels;
+		for (int c = 0; c < channels; ++c)
+		{
+			paddedRow[(x + radius) * channels + c] = pixel[c];
+		}
+	}
+	const float* padded = paddedRow.data();
+#pragma omp simd
+	for (int i = 0; i < length; ++i)
+	{
+		output[i] = 0.0f;
+	}
+	for (size_t k = 0; k < weights.size(); ++k)
+	{
+		accumulateWeightedRow(output, padded + k * channels, weights[k], length);
+	}
+}
+
+// Filtra las filas [top, bottom) con el núcleo y deja los resultados en output, (bottom - top) filas de columns * channels valores
+void convolveStrip(const Mat& inputImage, const SeparableKernel& kernel, int top, int bottom, ConvolutionBuffers& buffers, float* output)
+{
+	int columns = inputImage.cols;
+	int channels = inputImage.channels();
+	int length = columns * channels;
+	int radius = kernel.vertical.size() / 2;
+	int firstRow = top - radius;
+	int rowQuantity = bottom - top + 2 * radius;
+
+	buffers.horizontalRows.resize(static_cast<size_t>(rowQuantity) * length);
+	for (int i = 0; i < rowQuantity; ++i)
+	{
+		const uchar* row = inputImage.ptr<uchar>(reflectIndex(firstRow + i, inputImage.rows));
+		convolveRowHorizontal(row, columns, channels, kernel.horizontal, buffers.paddedRow, buffers.horizontalRows.data() + static_cast<size_t>(i) * length);
 	}
 
+	for (int y = top; y < bottom; ++y)
+	{
+		float* outputRow = output + static_cast<size_t>(y - top) * length;
+#pragma omp simd
+		for (int i = 0; i < length; ++i)
+		{
+			outputRow[i] = 0.0f;
+		}
+		for (size_t k = 0; k < kernel.vertical.size(); ++k)
+		{
+			accumulateWeightedRow(outputRow, buffers.horizontalRows.data() + static_cast<size_t>(y - top + k) * length, kernel.vertical[k], length);
+		}
+	}
+}
+
+// Aplica los núcleos a la imagen por franjas y combina sus resultados en cada píxel de salida
+Mat applyConvolution(const Mat& inputImage, const vector<SeparableKernel>& kernels, ConvolutionCombine combine, double amount, int threads)
+{
+	Mat outputImage(inputImage.rows, inputImage.cols, inputImage.type());
+	int length = inputImage.cols * inputImage.channels();
+	int stripHeight = getConvolutionStripHeight(inputImage.rows, length, kernels);
+	int strips = (inputImage.rows + stripHeight - 1) / stripHeight;
+	size_t stripLength = static_cast<size_t>(stripHeight) * length;
+	float weight = static_cast<float>(amount);
+
+#pragma omp parallel num_threads(threads)
+	{
+		ConvolutionBuffers buffers;
+		buffers.results.resize(stripLength * kernels.size());
+#pragma omp for schedule(dynamic)
+		for (int strip = 0; strip < strips; ++strip)
+		{
+			int top = strip * stripHeight;
+			int bottom = min(top + stripHeight, inputImage.rows);
+			for (size_t k = 0; k < kernels.size(); ++k)
+			{
+				convolveStrip(inputImage, kernels[k], top, bottom, buffers, buffers.results.data() + k * stripLength);
+			}
+			for (int y = top; y < bottom; ++y)
+			{
+				const uchar* inputRow = inputImage.ptr<uchar>(y);
+				uchar* outputRow = outputImage.ptr<uchar>(y);
+				const float* first = buffers.results.data() + static_cast<size_t>(y - top) * length;
+				const float* second = kernels.size() > 1 ? first + stripLength : first;
+				for (int i = 0; i < length; ++i)
+				{
+					float value;
+					switch (combine)
+					{
+					case ConvolutionCombine::UNSHARP_MASK:
+						value = inputRow[i] + weight * (inputRow[i] - first[i]);
+						break;
+					case ConvolutionCombine::GRADIENT_MAGNITUDE:
+						value = sqrt(first[i] * first[i] + second[i] * second[i]);
+						break;
+					case ConvolutionCombine::ABSOLUTE_SUM:
+						value = fabs(first[i] + second[i]);
+						break;
+					default:
+						value = first[i];
+						break;
+					}
+					outputRow[i] = saturate_cast<uchar>(value);
+				}
+			}
+		}
+	}
 	return outputImage;
 }
 
-void filter(vector<Mat> images, string FILTERS_IMAGES_PATH, string FILTERS_IMAGES_PATH_PROCESSED){
+Mat gaussianBlur(const Mat& inputImage, double sigma, int threads)
+{
+	return applyConvolution(inputImage, vector<SeparableKernel>(1, gaussianKernel(sigma)), ConvolutionCombine::FIRST, 0.0, threads);
+}
+
+Mat boxBlur(const Mat& inputImage, int radius, int threads)
+{
+	return applyConvolution(inputImage, vector<SeparableKernel>(1, boxKernel(radius)), ConvolutionCombine::FIRST, 0.0, threads);
+}
+
+// Realza los bordes sumando amount veces la diferencia entre la imagen y su desenfoque gaussiano
+Mat unsharpMask(const Mat& inputImage, double sigma, double amount, int threads)
+{
+	return applyConvolution(inputImage, vector<SeparableKernel>(1, gaussianKernel(sigma)), ConvolutionCombine::UNSHARP_MASK, amount, threads);
+}
+
+// Magnitud del gradiente de Sobel por canal
+Mat sobelEdges(const Mat& inputImage, int threads)
+{
+	return applyConvolution(inputImage, sobelKernels(), ConvolutionCombine::GRADIENT_MAGNITUDE, 0.0, threads);
+}
+
+// Valor absoluto del laplaciano por canal, como suma de las segundas derivadas en x y en y
+Mat laplacianEdges(const Mat& inputImage, int threads)
+{
+	return applyConvolution(inputImage, laplacianKernels(), ConvolutionCombine::ABSOLUTE_SUM, 0.0, threads);
+}
+
+vector<string> getFiltersBenchmarkRow(const string& imagePath, const Mat& image, const string& filterName, const string& implementation, unsigned int threads, const string& stripHeight, const TimingStatistics& statistics, const string& maxDifference)
+{
+	return {imagePath, to_string(image.cols) + "x" + to_string(image.rows), to_string(image.cols * image.rows), filterName, implementation, to_string(threads), stripHeight, formatBenchmarkNumber(statistics.median), maxDifference};
+}
+
+// Altura de franja que applyConvolution() elige para la imagen con esos núcleos, para la fila del benchmark
+string getConvolutionStripHeightColumn(const Mat& image, const vector<SeparableKernel>& kernels)
+{
+	return to_string(getConvolutionStripHeight(image.rows, image.cols * image.channels(), kernels));
+}
+
+/*
+Compara gaussianBlur() con GaussianBlur() de OpenCV sobre la misma imagen y los mismos hilos, y mide los demás
+filtros de convolución. Cada fila incluye la altura de franja elegida y la mayor diferencia por canal contra el
+resultado de OpenCV.
+La decodificación (imread sin caché) y la codificación (imencode a PNG) se miden como etapas aparte.
+*/
+void benchmarkFilters(const BenchmarkConfig& config, const vector<string>& imagePaths)
+{
+	const double sigma = 2.0;
+	BenchmarkReport report;
+	if (!openBenchmarkReport(report, FILTERS_BENCHMARK_RESULTS, FILTERS_BENCHMARK_COLUMNS))
+	{
+		cout << "Error opening file " << FILTERS_BENCHMARK_RESULTS << endl;
+		return;
+	}
+
+	for (const string& imagePath : imagePaths)
+	{
+		Mat image = readCachedImage(imagePath);
+		if (image.empty())
+		{
+			cout << "Error reading image " << imagePath << endl;
+			continue;
+		}
+		TimingStatistics statistics = measure(config, [&imagePath]() { imread(imagePath); });
+		writeBenchmarkResult(report, getFiltersBenchmarkRow(imagePath, image, "none", "opencv", 1, "-", statistics, "-"), BenchmarkStage::DECODE, statistics);
+
+		Mat reference;
+		Mat blurred;
+		for (unsigned int threads : config.threadCounts)
+		{
+			cout << "Filtering image " << imagePath << " with resolution " << image.cols << "x" << image.rows << " using " << threads << " threads" << endl;
+			setNumThreads(threads);
+			statistics = measure(config, [&]() { GaussianBlur(image, reference, Size(0, 0), sigma, sigma, BORDER_REFLECT_101); });
+			writeBenchmarkResult(report, getFiltersBenchmarkRow(imagePath, image, "gaussian_blur", "opencv", threads, "-", statistics, "0"), BenchmarkStage::COMPUTE, statistics);
+
+			statistics = measure(config, [&]() { blurred = gaussianBlur(image, sigma, threads); });
+			writeBenchmarkResult(report, getFiltersBenchmarkRow(imagePath, image, "gaussian_blur", "separable", threads, getConvolutionStripHeightColumn(image, vector<SeparableKernel>(1, gaussianKernel(sigma))), statistics, to_string(norm(blurred, reference, NORM_INF))), BenchmarkStage::COMPUTE, statistics);
+
+			statistics = measure(config, [&]() { boxBlur(image, 2, threads); });
+			writeBenchmarkResult(report, getFiltersBenchmarkRow(imagePath, image, "box_blur", "separable", threads, getConvolutionStripHeightColumn(image, vector<SeparableKernel>(1, boxKernel(2))), statistics, "-"), BenchmarkStage::COMPUTE, statistics);
+
+			statistics = measure(config, [&]() { unsharpMask(image, sigma, 1.0, threads); });
+			writeBenchmarkResult(report, getFiltersBenchmarkRow(imagePath, image, "unsharp_mask", "separable", threads, getConvolutionStripHeightColumn(image, vector<SeparableKernel>(1, gaussianKernel(sigma))), statistics, "-"), BenchmarkStage::COMPUTE, statistics);
+
+			statistics = measure(config, [&]() { sobelEdges(image, threads); });
+			writeBenchmarkResult(report, getFiltersBenchmarkRow(imagePath, image, "sobel", "separable", threads, getConvolutionStripHeightColumn(image, sobelKernels()), statistics, "-"), BenchmarkStage::COMPUTE, statistics);
+
+			statistics = measure(config, [&]() { laplacianEdges(image, threads); });
+			writeBenchmarkResult(report, getFiltersBenchmarkRow(imagePath, image, "laplacian", "separable", threads, getConvolutionStripHeightColumn(image, laplacianKernels()), statistics, "-"), BenchmarkStage::COMPUTE, statistics);
+		}
+		setNumThreads(-1);
+
+		vector<uchar> encoded;
+		statistics = measure(config, [&]() { imencode(".png", blurred, encoded); });
+		writeBenchmarkResult(report, getFiltersBenchmarkRow(imagePath, image, "gaussian_blur", "opencv", 1, "-", statistics, "-"), BenchmarkStage::ENCODE, statistics);
+	}
+	closeBenchmarkReport(report);
+}
+
+void benchmarkFilters(string imagePath, unsigned int maxThreads)
+{
+	benchmarkFilters(createBenchmarkConfig(maxThreads), vector<string>(1, imagePath));
+}
+
+void filter(const vector<Mat>& images, string FILTERS_IMAGES_PATH, string FILTERS_IMAGES_PATH_PROCESSED){
     cout << "Probando la lectura de imágenes\n";
 	// vector<Mat> images = readImages(FILTERS_IMAGES_PATH + "*.jpg");
 	for (size_t i = 0; i < images.size(); ++i)
 	{
-		Mat image = images[i];
+		const Mat& image = images[i];
 		cout << "Image size: " << image.cols << " x " << image.rows << '\n';
 
 		// Aplicar contraste
@@ -0,0 +1 @@
+g++ -c kernels.cpp -o kernels.o -std=c++11 -O3 -fPIC -ffp-contract=off && ar rcs libimagekernels.a kernels.o
\ No newline at end of file
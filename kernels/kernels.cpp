@@ -0,0 +1,262 @@
+// Built into libimagekernels.a by build_kernels.sh; programs include kernels.hpp and link the library.
+
+#include <atomic>
+#include <cstring>
+#include <immintrin.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include "kernels.hpp"
+
+using namespace std;
+
+// ------------------------------------------------------
+// Variants
+
+// The kernel sources are included once per variant, each time inside its own namespace and under its own
+// #pragma GCC target, so the same code is compiled for every instruction set without -m flags. GCC does not
+// define __AVX2__ and friends inside a target pragma in C++, so the sources test KERNEL_* macros instead, set
+// here for each variant.
+// Every variant lives in kernel_variants, so its names never collide with those of the programs linking the library.
+// The scalar variant also turns the vectorizer off, which makes it a true baseline for the other variants.
+// FMA is left out of every target list, and build_kernels.sh passes -ffp-contract=off, so floating-point
+// kernels round the same way in every variant.
+
+namespace kernel_variants
+{
+#pragma GCC push_options
+#pragma GCC optimize("no-tree-vectorize")
+namespace scalar
+{
+#include "row_kernels.hpp"
+#include "../steganography/lsb.hpp"
+}
+#pragma GCC pop_options
+
+#define KERNEL_SSE2
+#pragma GCC push_options
+#pragma GCC target("sse4.2,popcnt")
+namespace sse42
+{
+#include "row_kernels.hpp"
+#include "../steganography/lsb.hpp"
+}
+#pragma GCC pop_options
+
+#define KERNEL_BMI2
+#define KERNEL_AVX2
+#pragma GCC push_options
+#pragma GCC target("sse4.2,popcnt,avx,avx2,bmi,bmi2")
+namespace avx2
+{
+#include "row_kernels.hpp"
+#include "../steganography/lsb.hpp"
+}
+#pragma GCC pop_options
+
+#define KERNEL_AVX512BW
+#pragma GCC push_options
+#pragma GCC target("sse4.2,popcnt,avx,avx2,bmi,bmi2,avx512f,avx512bw,avx512vl,avx512dq")
+namespace avx512
+{
+#include "row_kernels.hpp"
+#include "../steganography/lsb.hpp"
+}
+#pragma GCC pop_options
+
+// Ice Lake and later add VBMI to AVX-512; only the lookup table kernel uses it
+#define KERNEL_AVX512VBMI
+#pragma GCC push_options
+#pragma GCC target("sse4.2,popcnt,avx,avx2,bmi,bmi2,avx512f,avx512bw,avx512vl,avx512dq,avx512vbmi")
+namespace avx512vbmi
+{
+#include "row_kernels.hpp"
+}
+#pragma GCC pop_options
+}
+
+#undef KERNEL_SSE2
+#undef KERNEL_BMI2
+#undef KERNEL_AVX2
+#undef KERNEL_AVX512BW
+#undef KERNEL_AVX512VBMI
+
+// ------------------------------------------------------
+// Dispatch
+
+namespace
+{
+struct KernelTable
+{
+	KernelVariant variant;
+	void (*accumulateRow)(const unsigned char *, unsigned short *, size_t);
+	void (*applyLookupTableRow)(const unsigned char *, unsigned char *, size_t, const unsigned char *);
+	void (*accumulateWeightedRow)(float *, const float *, float, size_t);
+	void (*embedLsbBytes)(unsigned char *, size_t, const unsigned char *, size_t);
+	void (*extractLsbBytes)(const unsigned char *, size_t, unsigned char *, size_t);
+	void (*embedPackedLsbBytes)(unsigned char *, unsigned, const unsigned char *, size_t);
+	void (*extractPackedLsbBytes)(const unsigned char *, unsigned, unsigned char *, size_t);
+};
+
+#define KERNEL_TABLE(variant, name, lookup) {variant, kernel_variants::name::accumulateRow, kernel_variants::lookup::applyLookupTableRow, kernel_variants::name::accumulateWeightedRow, kernel_variants::name::embedLsbBytes, kernel_variants::name::extractLsbBytes, kernel_variants::name::embedPackedLsbBytes, kernel_variants::name::extractPackedLsbBytes}
+
+// Indexed by KernelVariant, plus the AVX-512 table with the VBMI lookup kernel at the end
+const KernelTable KERNEL_TABLES[] = {
+	KERNEL_TABLE(KernelVariant::SCALAR, scalar, scalar),
+	KERNEL_TABLE(KernelVariant::SSE42, sse42, sse42),
+	KERNEL_TABLE(KernelVariant::AVX2, avx2, avx2),
+	KERNEL_TABLE(KernelVariant::AVX512, avx512, avx512),
+	KERNEL_TABLE(KernelVariant::AVX512, avx512, avx512vbmi)};
+const size_t AVX512VBMI_KERNEL_TABLE = 4;
+}
+
+string parseKernelVariant(KernelVariant variant)
+{
+	switch (variant)
+	{
+	case KernelVariant::SCALAR:
+		return "scalar";
+	case KernelVariant::SSE42:
+		return "sse4.2";
+	case KernelVariant::AVX2:
+		return "avx2";
+	case KernelVariant::AVX512:
+		return "avx512";
+	default:
+		return "unknown";
+	}
+}
+
+bool findKernelVariant(const string &name, KernelVariant &variant)
+{
+	for (KernelVariant candidate : AllKernelVariants)
+	{
+		if (parseKernelVariant(candidate) == name)
+		{
+			variant = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+// __builtin_cpu_supports() reads cpuid once, at startup, and for the AVX variants also checks with xgetbv that
+// the operating system saves the wide registers
+bool isKernelVariantSupported(KernelVariant variant)
+{
+	__builtin_cpu_init();
+	bool sse42 = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+	bool avx2 = sse42 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2");
+	switch (variant)
+	{
+	case KernelVariant::SCALAR:
+		return true;
+	case KernelVariant::SSE42:
+		return sse42;
+	case KernelVariant::AVX2:
+		return avx2;
+	case KernelVariant::AVX512:
+		return avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq");
+	default:
+		return false;
+	}
+}
+
+KernelVariant detectKernelVariant()
+{
+	KernelVariant best = KernelVariant::SCALAR;
+	for (KernelVariant variant : AllKernelVariants)
+	{
+		if (isKernelVariantSupported(variant))
+		{
+			best = variant;
+		}
+	}
+	return best;
+}
+
+const KernelTable *getKernelTable(KernelVariant variant)
+{
+	if (variant == KernelVariant::AVX512 && __builtin_cpu_supports("avx512vbmi"))
+	{
+		return &KERNEL_TABLES[AVX512VBMI_KERNEL_TABLE];
+	}
+	return &KERNEL_TABLES[static_cast<size_t>(variant)];
+}
+
+// The startup choice: KERNEL_VARIANT from the environment if the CPU supports it, the best variant otherwise
+const KernelTable *selectKernelTable()
+{
+	KernelVariant variant = detectKernelVariant();
+	const char *name = getenv("KERNEL_VARIANT");
+	KernelVariant requested;
+	if (name && findKernelVariant(name, requested) && isKernelVariantSupported(requested))
+	{
+		variant = requested;
+	}
+	return getKernelTable(variant);
+}
+
+atomic<const KernelTable *> &currentKernelTable()
+{
+	static atomic<const KernelTable *> table(selectKernelTable());
+	return table;
+}
+
+const KernelTable &kernels()
+{
+	return *currentKernelTable().load(memory_order_relaxed);
+}
+
+KernelVariant getKernelVariant()
+{
+	return kernels().variant;
+}
+
+bool setKernelVariant(KernelVariant variant)
+{
+	if (!isKernelVariantSupported(variant))
+	{
+		return false;
+	}
+	currentKernelTable() = getKernelTable(variant);
+	return true;
+}
+
+// ------------------------------------------------------
+// Kernels
+
+void accumulateRow(const unsigned char *row, unsigned short *columnSums, size_t length)
+{
+	kernels().accumulateRow(row, columnSums, length);
+}
+
+void applyLookupTableRow(const unsigned char *source, unsigned char *destination, size_t length, const unsigned char *table)
+{
+	kernels().applyLookupTableRow(source, destination, length, table);
+}
+
+void accumulateWeightedRow(float *output, const float *source, float weight, size_t length)
+{
+	kernels().accumulateWeightedRow(output, source, weight, length);
+}
+
+void embedLsbBytes(unsigned char *channels, size_t stride, const unsigned char *payload, size_t count)
+{
+	kernels().embedLsbBytes(channels, stride, payload, count);
+}
+
+void extractLsbBytes(const unsigned char *channels, size_t stride, unsigned char *payload, size_t count)
+{
+	kernels().extractLsbBytes(channels, stride, payload, count);
+}
+
+void embedPackedLsbBytes(unsigned char *channels, unsigned bitsPerChannel, const unsigned char *payload, size_t count)
+{
+	kernels().embedPackedLsbBytes(channels, bitsPerChannel, payload, count);
+}
+
+void extractPackedLsbBytes(const unsigned char *channels, unsigned bitsPerChannel, unsigned char *payload, size_t count)
+{
+	kernels().extractPackedLsbBytes(channels, bitsPerChannel, payload, count);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// ------------------------------------------------------
+// Image kernels library
+
+// The hot row kernels of the filters, the compressor and the steganography code live in libimagekernels.a,
+// built by kernels/build_kernels.sh. Every kernel is compiled in a scalar, an SSE4.2, an AVX2 and an AVX-512
+// variant. The first call picks the best variant the CPU supports, so one binary runs on every x86-64 host
+// without -march flags. Setting KERNEL_VARIANT=<name> in the environment or calling setKernelVariant()
+// overrides the choice, for instance to benchmark the variants against each other on one machine.
+// All variants of a kernel return the same bytes; only their speed differs.
+
+enum class KernelVariant
+{
+	SCALAR,
+	SSE42,
+	AVX2,
+	AVX512
+};
+
+const vector<KernelVariant> AllKernelVariants = {KernelVariant::SCALAR, KernelVariant::SSE42, KernelVariant::AVX2, KernelVariant::AVX512};
+
+string parseKernelVariant(KernelVariant variant);
+
+// Looks a variant up by the name parseKernelVariant() gives it; returns false for unknown names
+bool findKernelVariant(const string &name, KernelVariant &variant);
+
+// Whether this CPU (and its operating system, for the wide registers) can run the variant
+bool isKernelVariantSupported(KernelVariant variant);
+
+// The best variant this CPU supports
+KernelVariant detectKernelVariant();
+
+KernelVariant getKernelVariant();
+
+// Returns false, and keeps the current variant, when the CPU does not support the requested one
+bool setKernelVariant(KernelVariant variant);
+
+// Adds a row of channel bytes to columnSums, one 16-bit accumulator per byte
+void accumulateRow(const unsigned char *row, unsigned short *columnSums, size_t length);
+
+// Maps length bytes through a 256-byte table; source and destination may be the same row
+void applyLookupTableRow(const unsigned char *source, unsigned char *destination, size_t length, const unsigned char *table);
+
+// output[i] += weight * source[i] for length values; the rows must not overlap
+void accumulateWeightedRow(float *output, const float *source, float weight, size_t length);
+
+// Hides count bytes of payload in the least significant bits of channels, one 8-channel window every stride channels
+void embedLsbBytes(unsigned char *channels, size_t stride, const unsigned char *payload, size_t count);
+
+void extractLsbBytes(const unsigned char *channels, size_t stride, unsigned char *payload, size_t count);
+
+// Hides count bytes with bitsPerChannel (1 to 4) bits in every channel, packed without gaps
+void embedPackedLsbBytes(unsigned char *channels, unsigned bitsPerChannel, const unsigned char *payload, size_t count);
+
+void extractPackedLsbBytes(const unsigned char *channels, unsigned bitsPerChannel, unsigned char *payload, size_t count);
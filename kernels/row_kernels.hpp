@@ -0,0 +1,92 @@
+// Row kernels of the filters and the compressor. No include guard: kernels.cpp includes this file once per
+// variant, inside the variant's namespace and target, with the KERNEL_* macros of that variant defined.
+// The headers it needs are included by kernels.cpp before any variant.
+
+// Adds a row of channel bytes to columnSums, one 16-bit accumulator per byte.
+// A block column holds at most 16 rows of 255, so 16 bits never overflow.
+void accumulateRow(const unsigned char *row, unsigned short *columnSums, size_t length)
+{
+	size_t i = 0;
+#if defined(KERNEL_AVX512BW)
+	for (; i + 64 <= length; i += 64)
+	{
+		__m512i low = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + i)));
+		__m512i high = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + i + 32)));
+		unsigned short *sums = columnSums + i;
+		_mm512_storeu_si512(sums, _mm512_add_epi16(_mm512_loadu_si512(sums), low));
+		_mm512_storeu_si512(sums + 32, _mm512_add_epi16(_mm512_loadu_si512(sums + 32), high));
+	}
+#endif
+#if defined(KERNEL_AVX2)
+	for (; i + 32 <= length; i += 32)
+	{
+		__m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + i));
+		__m256i low = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes));
+		__m256i high = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1));
+		__m256i *sums = reinterpret_cast<__m256i *>(columnSums + i);
+		_mm256_storeu_si256(sums, _mm256_add_epi16(_mm256_loadu_si256(sums), low));
+		_mm256_storeu_si256(sums + 1, _mm256_add_epi16(_mm256_loadu_si256(sums + 1), high));
+	}
+#endif
+#if defined(KERNEL_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= length; i += 16)
+	{
+		__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+		__m128i *sums = reinterpret_cast<__m128i *>(columnSums + i);
+		_mm_storeu_si128(sums, _mm_add_epi16(_mm_loadu_si128(sums), _mm_unpacklo_epi8(bytes, zero)));
+		_mm_storeu_si128(sums + 1, _mm_add_epi16(_mm_loadu_si128(sums + 1), _mm_unpackhi_epi8(bytes, zero)));
+	}
+#endif
+	for (; i < length; ++i)
+	{
+		columnSums[i] += row[i];
+	}
+}
+
+// Maps length bytes through a 256-byte table; source and destination may be the same row.
+// With AVX-512 VBMI the whole table fits in four registers and vpermi2b resolves 64 lookups per instruction.
+// Without it, a lookup in a 256-byte table that stays in L1 is cheaper than emulating it with pshufb over
+// 16 sub-tables, so the unrolled scalar loop is used.
+void applyLookupTableRow(const unsigned char *source, unsigned char *destination, size_t length, const unsigned char *table)
+{
+	size_t i = 0;
+#if defined(KERNEL_AVX512VBMI)
+	const __m512i lowTable0 = _mm512_loadu_si512(table);
+	const __m512i lowTable1 = _mm512_loadu_si512(table + 64);
+	const __m512i highTable0 = _mm512_loadu_si512(table + 128);
+	const __m512i highTable1 = _mm512_loadu_si512(table + 192);
+	for (; i + 64 <= length; i += 64)
+	{
+		__m512i indexes = _mm512_loadu_si512(source + i);
+		__m512i low = _mm512_permutex2var_epi8(lowTable0, indexes, lowTable1);
+		__m512i high = _mm512_permutex2var_epi8(highTable0, indexes, highTable1);
+		_mm512_storeu_si512(destination + i, _mm512_mask_blend_epi8(_mm512_movepi8_mask(indexes), low, high));
+	}
+#endif
+	for (; i + 4 <= length; i += 4)
+	{
+		unsigned char first = table[source[i]];
+		unsigned char second = table[source[i + 1]];
+		unsigned char third = table[source[i + 2]];
+		unsigned char fourth = table[source[i + 3]];
+		destination[i] = first;
+		destination[i + 1] = second;
+		destination[i + 2] = third;
+		destination[i + 3] = fourth;
+	}
+	for (; i < length; ++i)
+	{
+		destination[i] = table[source[i]];
+	}
+}
+
+// output[i] += weight * source[i], the inner loop of both convolution passes. The loop is left to the
+// vectorizer, which uses the widest registers of the variant's target; the rows never overlap.
+void accumulateWeightedRow(float *__restrict output, const float *__restrict source, float weight, size_t length)
+{
+	for (size_t i = 0; i < length; ++i)
+	{
+		output[i] += weight * source[i];
+	}
+}
@@ -7,6 +7,9 @@
 #include "filters/filter.cpp"
 #include "compression/compression.cpp"
 #include "steganography/multi.cpp"
+#include "pipeline/scheduler.cpp"
+#include "pipeline/pipeline.cpp"
+#include "service/service.cpp"
 
 
 using namespace std;
@@ -14,6 +17,7 @@ using namespace cv;
 
 const string FILTERS_IMAGES_PATH = "images/filters/";
 const string FILTERS_IMAGES_PATH_PROCESSED = "images/filters/processed/";
+const string STEGANOGRAPHY_BATCH_PATH = "results/multi/batch_";
 enum class ImageReadResult
 {
 	SUCCESS,
@@ -22,7 +26,7 @@ enum class ImageReadResult
 
 ImageReadResult readImage(string path, Mat& image)
 {
-	image = imread(path);
+	image = readCachedImage(path);
 	if (image.empty())
 	{
 		return ImageReadResult::FAILURE;
@@ -46,11 +50,116 @@ vector<Mat> readImages(string path)
 	return images;
 }
 
+size_t filterBatch(string pattern, string outputPath)
+{
+	return runBatchPipeline(
+		pattern,
+		[](Mat image, int threads) { return applyContrast(image, -1, 650, 600); },
+		[outputPath](const BatchItem& item) { return outputPath + "contrast_image_" + to_string(item.index) + ".jpg"; });
+}
+
+size_t compressBatch(string pattern, string outputPath, ImageCompressionRate rate)
+{
+	return runBatchPipeline(
+		pattern,
+		[rate](Mat image, int threads) { size_t pixelGroupQuantity, pixelGroupQuantityPerThread; return compressImageThreads(image, rate, pixelGroupQuantity, pixelGroupQuantityPerThread, threads); },
+		[outputPath, rate](const BatchItem& item) { return outputPath + to_string(item.index) + "_compressed_" + parseImageCompressionRate(rate) + ".tiff"; });
+}
+
+// Hides the same payload file in every container; containers too small for it are reported and skipped
+size_t embedBatch(string pattern, string outputPath, const char* payloadPath, unsigned bitsPerChannel = DEFAULT_BITS_PER_CHANNEL)
+{
+	MappedPayload payload;
+	if (!mapPayload(payloadPath, payload))
+	{
+		return 0;
+	}
+	size_t written = runBatchPipeline(
+		pattern,
+		[&payload, bitsPerChannel](Mat image, int threads) {
+			try
+			{
+				parallelEmbed(image, payload, threads, bitsPerChannel);
+			}
+			catch (const runtime_error&)
+			{
+				return Mat();
+			}
+			return image;
+		},
+		// The container is saved as PNG: a lossy format would destroy the embedded bits
+		[outputPath](const BatchItem& item) { return outputPath + to_string(item.index) + ".png"; });
+	unmapPayload(payload);
+	return written;
+}
+
+void benchmarkScheduling(const BenchmarkConfig& config, const vector<Mat>& filterImages, const vector<Mat>& compressionImages)
+{
+	BenchmarkReport report;
+	if (!openBenchmarkReport(report, SCHEDULING_BENCHMARK_RESULTS, SCHEDULING_BENCHMARK_COLUMNS))
+	{
+		cout << "Error opening file " << SCHEDULING_BENCHMARK_RESULTS << endl;
+		return;
+	}
+	testScheduling(config, "filter", filterImages, [](Mat& image, int threads) { image = applyContrast(image, -1, 650, 600); }, report);
+	testScheduling(config, "compression", compressionImages, [](Mat& image, int threads) {
+		size_t pixelGroupQuantity, pixelGroupQuantityPerThread;
+		compressImageThreads(image, ImageCompressionRate::MEDIUM, pixelGroupQuantity, pixelGroupQuantityPerThread, threads);
+	}, report);
+	closeBenchmarkReport(report);
+}
+
+void writeTrace(const char* traceFile)
+{
+	setTracingEnabled(false);
+	writeChromeTrace(traceFile);
+	writeTraceSummary(string(traceFile) + ".csv");
+}
+
 int main(int argc, char** argv)
 {
-	filter(readImages(FILTERS_IMAGES_PATH + "*.jpg"), FILTERS_IMAGES_PATH, FILTERS_IMAGES_PATH_PROCESSED);
-	benchmark(32); //compression
+	// TRACE_FILE=trace.json records a Chrome trace plus per-region imbalance in trace.json.csv;
+	// TRACE_COUNTERS=1 adds cycles and LLC misses to every span
+	const char* traceFile = getenv("TRACE_FILE");
+	if (traceFile)
+	{
+		setTracingEnabled(true, getenv("TRACE_COUNTERS") != nullptr);
+	}
+	// ./main serve [socket path] runs jobs from stdin, or from clients of the socket, until stopped
+	if (argc > 1 && argv[1] == SERVICE_COMMAND)
+	{
+		int status = runService(argc > 2 ? argv[2] : "");
+		if (traceFile)
+		{
+			writeTrace(traceFile);
+		}
+		return status;
+	}
+	// ./main [openmp|thread_pool] [repetitions] picks the backend the parallel kernels run on and how many
+	// timed repetitions every benchmark measurement takes
+	ExecutionBackend backend;
+	if (argc > 1 && findExecutionBackend(argv[1], backend))
+	{
+		setExecutionBackend(backend);
+	}
+	BenchmarkConfig config = createBenchmarkConfig(32);
+	if (argc > 2 && atoi(argv[2]) > 0)
+	{
+		config.repetitions = atoi(argv[2]);
+	}
+	filterBatch(FILTERS_IMAGES_PATH + "*.jpg", FILTERS_IMAGES_PATH_PROCESSED);
+	benchmarkFilters(config, vector<string>(1, FILTERS_IMAGES_PATH + "img_01.jpg"));
+	benchmark(config, {COMPRESSION_IMAGES_PATH + "img_01.tiff", COMPRESSION_IMAGES_PATH + "img_05.tiff"}); //compression
+	compressBatch(COMPRESSION_IMAGES_PATH + "*.tiff", COMPRESSION_IMAGES_PATH_PROCESSED, ImageCompressionRate::MEDIUM);
+	benchmarkScheduling(config, readImages(FILTERS_IMAGES_PATH + "*.jpg"), readImages(COMPRESSION_IMAGES_PATH + "*.tiff"));
 	steganography(20);
+	benchmarkSteganography(createBenchmarkConfig(20, config.warmup, config.repetitions), IMAGE_PATH, INFO_TO_EMBED_PATH);
+	steganographySharded(vector<string>(4, "./containers/mona_lisa.jpg"), "./info/too_large_img.jpg", 20);
+	embedBatch("./containers/*.jpg", STEGANOGRAPHY_BATCH_PATH, INFO_TO_EMBED_PATH);
+	if (traceFile)
+	{
+		writeTrace(traceFile);
+	}
 	//🙂
 	return EXIT_SUCCESS;
 }
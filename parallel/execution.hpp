@@ -0,0 +1,296 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <omp.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../trace/trace.hpp"
+
+using namespace std;
+
+// ------------------------------------------------------
+// Execution backends
+
+// Parallel kernels split their work with parallelFor, which runs either on OpenMP or on a persistent thread pool.
+// The OpenMP backend opens a parallel region per call; the pool keeps its workers alive between calls, so a
+// stream of small requests does not pay region startup or team resizing every time.
+
+enum class ExecutionBackend
+{
+	OPENMP,
+	THREAD_POOL
+};
+
+const vector<ExecutionBackend> AllExecutionBackends = {ExecutionBackend::OPENMP, ExecutionBackend::THREAD_POOL};
+
+// Processes [begin, end) on the worker with the given index, which is below the thread count of the call
+typedef function<void(int, int, int)> RangeBody;
+
+string parseExecutionBackend(ExecutionBackend backend)
+{
+	switch (backend)
+	{
+	case ExecutionBackend::OPENMP:
+		return "openmp";
+	case ExecutionBackend::THREAD_POOL:
+		return "thread_pool";
+	default:
+		return "unknown";
+	}
+}
+
+// Looks a backend up by the name parseExecutionBackend() gives it; returns false for unknown names
+bool findExecutionBackend(const string &name, ExecutionBackend &backend)
+{
+	for (ExecutionBackend candidate : AllExecutionBackends)
+	{
+		if (parseExecutionBackend(candidate) == name)
+		{
+			backend = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+ExecutionBackend &currentExecutionBackend()
+{
+	static ExecutionBackend backend = ExecutionBackend::OPENMP;
+	return backend;
+}
+
+void setExecutionBackend(ExecutionBackend backend)
+{
+	currentExecutionBackend() = backend;
+}
+
+ExecutionBackend getExecutionBackend()
+{
+	return currentExecutionBackend();
+}
+
+// Work-stealing pool: every worker has its own deque of chunks, takes from its back and, when empty, steals from
+// the front of the others. A call with threads threads only queues chunks on, and lets chunks be stolen by,
+// workers 0 to threads - 1, so thread sweeps measure exactly the requested number of threads.
+class ThreadPool
+{
+public:
+	static ThreadPool &instance()
+	{
+		static ThreadPool pool;
+		return pool;
+	}
+
+	void parallelFor(int begin, int end, int threads, int grain, const RangeBody &body)
+	{
+		if (end <= begin)
+		{
+			return;
+		}
+		// A call made from inside a worker runs inline, since the worker waiting on it could starve the pool
+		if (threads <= 1 || currentWorker() >= 0)
+		{
+			body(begin, end, 0);
+			return;
+		}
+		threads = min(threads, MAX_THREADS);
+		ensureWorkers(threads);
+
+		Job job;
+		job.body = &body;
+		job.threads = threads;
+		job.remaining = (end - begin + grain - 1) / grain;
+		int chunk = 0;
+		for (int chunkBegin = begin; chunkBegin < end; chunkBegin += grain, ++chunk)
+		{
+			Task task = {&job, chunkBegin, min(chunkBegin + grain, end)};
+			Worker &worker = *workers[chunk % threads];
+			lock_guard<mutex> lock(worker.workerMutex);
+			worker.tasks.push_back(task);
+		}
+		for (int w = 0; w < threads; ++w)
+		{
+			Worker &worker = *workers[w];
+			lock_guard<mutex> lock(worker.workerMutex);
+			worker.signalled = true;
+			worker.wake.notify_one();
+		}
+
+		unique_lock<mutex> lock(job.doneMutex);
+		job.done.wait(lock, [&job] { return job.remaining == 0; });
+	}
+
+	~ThreadPool()
+	{
+		for (size_t w = 0; w < workers.size(); ++w)
+		{
+			lock_guard<mutex> lock(workers[w]->workerMutex);
+			workers[w]->stopping = true;
+			workers[w]->wake.notify_one();
+		}
+		for (size_t w = 0; w < workers.size(); ++w)
+		{
+			workers[w]->handle.join();
+		}
+	}
+
+private:
+	static const int MAX_THREADS = 256;
+
+	struct Job
+	{
+		const RangeBody *body;
+		int threads;
+		int remaining;
+		mutex doneMutex;
+		condition_variable done;
+	};
+
+	struct Task
+	{
+		Job *job;
+		int begin;
+		int end;
+	};
+
+	struct Worker
+	{
+		Worker() : signalled(false), stopping(false) {}
+		mutex workerMutex;
+		condition_variable wake;
+		deque<Task> tasks;
+		bool signalled;
+		bool stopping;
+		thread handle;
+	};
+
+	ThreadPool() : workerQuantity(0)
+	{
+		workers.reserve(MAX_THREADS);
+		ensureWorkers(max(1u, thread::hardware_concurrency()));
+	}
+
+	static int &currentWorker()
+	{
+		static thread_local int worker = -1;
+		return worker;
+	}
+
+	// Workers are only ever added, and the vector never reallocates, so running workers can read it while it grows
+	void ensureWorkers(int threads)
+	{
+		lock_guard<mutex> lock(growMutex);
+		while (static_cast<int>(workers.size()) < threads)
+		{
+			workers.push_back(unique_ptr<Worker>(new Worker()));
+			int id = workers.size() - 1;
+			workers.back()->handle = thread(&ThreadPool::run, this, id);
+			workerQuantity = workers.size();
+		}
+	}
+
+	bool pop(int id, Task &task)
+	{
+		Worker &worker = *workers[id];
+		lock_guard<mutex> lock(worker.workerMutex);
+		if (worker.tasks.empty())
+		{
+			return false;
+		}
+		task = worker.tasks.back();
+		worker.tasks.pop_back();
+		return true;
+	}
+
+	bool steal(int id, Task &task)
+	{
+		int quantity = workerQuantity;
+		for (int offset = 1; offset < quantity; ++offset)
+		{
+			Worker &victim = *workers[(id + offset) % quantity];
+			lock_guard<mutex> lock(victim.workerMutex);
+			if (!victim.tasks.empty() && id < victim.tasks.front().job->threads)
+			{
+				task = victim.tasks.front();
+				victim.tasks.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void run(int id)
+	{
+		currentWorker() = id;
+		Worker &worker = *workers[id];
+		while (true)
+		{
+			Task task;
+			if (pop(id, task) || steal(id, task))
+			{
+				(*task.job->body)(task.begin, task.end, id);
+				lock_guard<mutex> lock(task.job->doneMutex);
+				if (--task.job->remaining == 0)
+				{
+					task.job->done.notify_all();
+				}
+				continue;
+			}
+			unique_lock<mutex> lock(worker.workerMutex);
+			worker.wake.wait(lock, [&worker] { return worker.signalled || worker.stopping; });
+			if (worker.stopping)
+			{
+				return;
+			}
+			worker.signalled = false;
+		}
+	}
+
+	vector<unique_ptr<Worker> > workers;
+	atomic<int> workerQuantity;
+	mutex growMutex;
+};
+
+void runParallelFor(int begin, int end, int threads, const RangeBody &body, int grain)
+{
+	if (getExecutionBackend() == ExecutionBackend::THREAD_POOL)
+	{
+		ThreadPool::instance().parallelFor(begin, end, threads, grain, body);
+		return;
+	}
+	int chunks = end > begin ? (end - begin + grain - 1) / grain : 0;
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+	for (int chunk = 0; chunk < chunks; ++chunk)
+	{
+		int chunkBegin = begin + chunk * grain;
+		body(chunkBegin, min(chunkBegin + grain, end), omp_get_thread_num());
+	}
+}
+
+// Splits [begin, end) in chunks of grain indexes (by default about four per thread) and runs them on the
+// current backend with up to threads workers. While tracing is on, every chunk is a span of the enclosing TraceRegion.
+void parallelFor(int begin, int end, int threads, const RangeBody &body, int grain = 0)
+{
+	threads = max(threads, 1);
+	if (grain <= 0)
+	{
+		grain = max(1, (end - begin) / (threads * 4));
+	}
+	if (isTracingEnabled())
+	{
+		TraceRegion *region = currentTraceRegion();
+		runParallelFor(begin, end, threads, [&body, region](int chunkBegin, int chunkEnd, int worker) {
+			TraceChunk chunk(region, worker, chunkEnd - chunkBegin);
+			body(chunkBegin, chunkEnd, worker);
+		}, grain);
+		return;
+	}
+	runParallelFor(begin, end, threads, body, grain);
+}
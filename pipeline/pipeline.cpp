@@ -0,0 +1,292 @@
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <omp.h>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../trace/trace.hpp"
+
+using namespace std;
+using namespace cv;
+
+// ------------------------------------------------------
+// Streaming batch pipeline
+
+// Decoder, processing and encoder threads work on different images at the same time, connected by bounded
+// queues. A memory budget caps the bytes of decoded pixels alive at once: decoders wait before handing a new
+// image over until encoders have released enough, so peak memory stays flat however many files the batch has.
+// Each image is charged its decoded size until it has been encoded; at most one image per decoder thread
+// can be held outside the budget while its decoder waits.
+// The processing stage shares computeThreads threads between the images it works on. Each decoded image is
+// planned with planBatchGroup() from scheduler.cpp, which main.cpp includes first: small images run on one thread
+// each, many at a time, and large ones get as many threads as their kernel can keep busy, so a batch that mixes
+// thumbnails and large photos keeps every thread working.
+
+struct BatchPipelineConfig
+{
+	unsigned int decoderThreads;
+	// Threads shared by the kernels of the processing stage
+	unsigned int computeThreads;
+	unsigned int encoderThreads;
+	size_t queueCapacity;
+	size_t memoryBudget;
+};
+
+const BatchPipelineConfig DEFAULT_BATCH_PIPELINE_CONFIG = {2, static_cast<unsigned int>(max(omp_get_max_threads(), 1)), 2, 4, size_t(512) << 20};
+
+struct BatchItem
+{
+	size_t index;
+	string path;
+	Mat image;
+	size_t bytes;
+};
+
+// Receives the decoded image, which no other stage shares, so it may be modified in place, and the threads its
+// kernel may use; OpenMP kernels that do not take a thread count get the same number as their default.
+// An operation that fails returns an empty Mat, and the image is dropped without being encoded.
+typedef function<Mat(Mat, int)> BatchOperation;
+typedef function<string(const BatchItem &)> BatchOutputPath;
+
+template <typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+	void push(T item)
+	{
+		unique_lock<mutex> lock(queueMutex);
+		notFull.wait(lock, [this] { return items.size() < capacity; });
+		items.push_back(move(item));
+		notEmpty.notify_one();
+	}
+
+	// Returns false once the queue is closed and empty
+	bool pop(T &item)
+	{
+		unique_lock<mutex> lock(queueMutex);
+		notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+		if (items.empty())
+		{
+			return false;
+		}
+		item = move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	void close()
+	{
+		lock_guard<mutex> lock(queueMutex);
+		closed = true;
+		notEmpty.notify_all();
+	}
+
+private:
+	size_t capacity;
+	bool closed;
+	deque<T> items;
+	mutex queueMutex;
+	condition_variable notEmpty;
+	condition_variable notFull;
+};
+
+// Counts the bytes of decoded images in flight. An image larger than the whole budget is still let through
+// when nothing else is in flight, so the pipeline never deadlocks on it.
+class MemoryBudget
+{
+public:
+	explicit MemoryBudget(size_t budget) : budget(budget), used(0) {}
+
+	void acquire(size_t bytes)
+	{
+		unique_lock<mutex> lock(budgetMutex);
+		released.wait(lock, [this, bytes] { return used == 0 || used + bytes <= budget; });
+		used += bytes;
+	}
+
+	void release(size_t bytes)
+	{
+		lock_guard<mutex> lock(budgetMutex);
+		used -= bytes;
+		released.notify_all();
+	}
+
+private:
+	size_t budget;
+	size_t used;
+	mutex budgetMutex;
+	condition_variable released;
+};
+
+// Counts the compute threads handed to the kernels running at once. Requests are served in arrival order, so a
+// large image waiting for every thread is not starved by small images taking one thread each.
+class ThreadBudget
+{
+public:
+	explicit ThreadBudget(unsigned int threads) : available(threads), nextTicket(0), servedTicket(0) {}
+
+	void acquire(unsigned int threads)
+	{
+		unique_lock<mutex> lock(budgetMutex);
+		size_t ticket = nextTicket++;
+		changed.wait(lock, [this, ticket, threads] { return ticket == servedTicket && available >= threads; });
+		available -= threads;
+		++servedTicket;
+		changed.notify_all();
+	}
+
+	void release(unsigned int threads)
+	{
+		lock_guard<mutex> lock(budgetMutex);
+		available += threads;
+		changed.notify_all();
+	}
+
+private:
+	unsigned int available;
+	size_t nextTicket;
+	size_t servedTicket;
+	mutex budgetMutex;
+	condition_variable changed;
+};
+
+// Closes queue once the last of its producers has finished
+class ProducerGroup
+{
+public:
+	ProducerGroup(unsigned int producers) : remaining(producers) {}
+
+	template <typename T>
+	void finish(BoundedQueue<T> &queue)
+	{
+		lock_guard<mutex> lock(groupMutex);
+		if (--remaining == 0)
+		{
+			queue.close();
+		}
+	}
+
+private:
+	unsigned int remaining;
+	mutex groupMutex;
+};
+
+// Decodes, processes and encodes every path, overlapping the three stages across images.
+// Returns the number of images written; a config without threads in some stage or without queue capacity
+// would never finish, so it writes nothing.
+size_t runBatchPipeline(const vector<string> &paths, BatchOperation operation, BatchOutputPath outputPath, const BatchPipelineConfig &config)
+{
+	if (config.decoderThreads == 0 || config.computeThreads == 0 || config.encoderThreads == 0 || config.queueCapacity == 0)
+	{
+		cerr << "Error: the batch pipeline needs at least one thread per stage and a queue capacity of at least 1" << endl;
+		return 0;
+	}
+	BoundedQueue<size_t> pathQueue(paths.size() + 1);
+	BoundedQueue<BatchItem> decodedQueue(config.queueCapacity);
+	BoundedQueue<BatchItem> processedQueue(config.queueCapacity);
+	MemoryBudget budget(config.memoryBudget);
+	ThreadBudget computeBudget(config.computeThreads);
+	ProducerGroup decoders(config.decoderThreads);
+	ProducerGroup processors(config.computeThreads);
+	mutex countMutex;
+	size_t written = 0;
+
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		pathQueue.push(i);
+	}
+	pathQueue.close();
+
+	vector<thread> threads;
+	for (unsigned int t = 0; t < config.decoderThreads; ++t)
+	{
+		threads.push_back(thread([&] {
+			size_t index;
+			while (pathQueue.pop(index))
+			{
+				BatchItem item;
+				item.index = index;
+				item.path = paths[index];
+				{
+					TraceRegion trace("imread");
+					item.image = imread(item.path);
+				}
+				if (item.image.empty())
+				{
+					cerr << "Error reading image " << item.path << endl;
+					continue;
+				}
+				item.bytes = item.image.total() * item.image.elemSize();
+				budget.acquire(item.bytes);
+				decodedQueue.push(move(item));
+			}
+			decoders.finish(decodedQueue);
+		}));
+	}
+	// One processing thread per compute thread, enough to run every image on a single thread at once
+	for (unsigned int t = 0; t < config.computeThreads; ++t)
+	{
+		threads.push_back(thread([&] {
+			BatchItem item;
+			while (decodedQueue.pop(item))
+			{
+				int computeThreads = config.computeThreads;
+				BatchPlan plan = planBatchGroup(paths.size(), computeThreads, getUsefulPixelThreads(item.image.total(), computeThreads));
+				computeBudget.acquire(plan.pixelThreads);
+				omp_set_num_threads(plan.pixelThreads);
+				// The processed image replaces the decoded one, which is freed here; the budget keeps counting
+				// the decoded size until the encoder is done
+				item.image = operation(item.image, plan.pixelThreads);
+				computeBudget.release(plan.pixelThreads);
+				if (item.image.empty())
+				{
+					budget.release(item.bytes);
+					continue;
+				}
+				processedQueue.push(move(item));
+			}
+			processors.finish(processedQueue);
+		}));
+	}
+	for (unsigned int t = 0; t < config.encoderThreads; ++t)
+	{
+		threads.push_back(thread([&] {
+			BatchItem item;
+			while (processedQueue.pop(item))
+			{
+				bool saved;
+				{
+					TraceRegion trace("imwrite");
+					saved = imwrite(outputPath(item), item.image);
+				}
+				size_t bytes = item.bytes;
+				item.image.release();
+				budget.release(bytes);
+				if (saved)
+				{
+					lock_guard<mutex> lock(countMutex);
+					++written;
+				}
+			}
+		}));
+	}
+	for (size_t t = 0; t < threads.size(); ++t)
+	{
+		threads[t].join();
+	}
+	return written;
+}
+
+size_t runBatchPipeline(string pattern, BatchOperation operation, BatchOutputPath outputPath, const BatchPipelineConfig &config = DEFAULT_BATCH_PIPELINE_CONFIG)
+{
+	vector<string> paths;
+	glob(pattern, paths);
+	return runBatchPipeline(paths, operation, outputPath, config);
+}
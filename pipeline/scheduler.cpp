@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <iostream>
+#include <omp.h>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include "../benchmark/benchmark.hpp"
+
+using namespace std;
+using namespace cv;
+
+// ------------------------------------------------------
+// Two-level batch scheduling
+
+// A batch can be parallelized across images, inside each image, or both. Splitting a small image across many
+// threads costs more in fork/join and imbalance than it gains, while a few large images leave cores idle if
+// each one only gets a single thread, so the strategy is chosen from the image sizes. Images are grouped by how
+// many threads a kernel can keep busy on them and every group gets its own plan, so a batch that mixes thumbnails
+// and large photos runs the thumbnails one per thread and the photos with every thread.
+// The streaming pipeline in pipeline.cpp plans each image as it is decoded with the same rules.
+
+const string SCHEDULING_BENCHMARK_COLUMNS = "workload,images,number_of_pixels,threads,strategy,image_threads,pixel_threads,time";
+const string SCHEDULING_BENCHMARK_RESULTS = "scheduling_results.csv";
+// Fewest pixels worth giving to one thread of a parallel kernel
+const size_t MIN_PIXELS_PER_THREAD = size_t(1) << 18;
+
+enum class ParallelismStrategy
+{
+	IMAGE_LEVEL,
+	PIXEL_LEVEL,
+	NESTED
+};
+
+const vector<ParallelismStrategy> AllParallelismStrategies = {ParallelismStrategy::IMAGE_LEVEL, ParallelismStrategy::PIXEL_LEVEL, ParallelismStrategy::NESTED};
+
+string parseParallelismStrategy(ParallelismStrategy strategy)
+{
+	switch (strategy)
+	{
+	case ParallelismStrategy::IMAGE_LEVEL:
+		return "image_level";
+	case ParallelismStrategy::PIXEL_LEVEL:
+		return "pixel_level";
+	case ParallelismStrategy::NESTED:
+		return "nested";
+	default:
+		return "unknown";
+	}
+}
+
+// How many images run at once and how many threads each image's kernel gets
+struct BatchPlan
+{
+	ParallelismStrategy strategy;
+	int imageThreads;
+	int pixelThreads;
+};
+
+// Threads a kernel can keep busy on an image of pixels pixels
+int getUsefulPixelThreads(size_t pixels, int threads)
+{
+	return static_cast<int>(max(static_cast<size_t>(1), min(static_cast<size_t>(threads), pixels / MIN_PIXELS_PER_THREAD)));
+}
+
+BatchPlan planBatch(ParallelismStrategy strategy, size_t imageQuantity, int threads, int usefulPixelThreads)
+{
+	BatchPlan plan;
+	plan.strategy = strategy;
+	int images = static_cast<int>(max(static_cast<size_t>(1), min(imageQuantity, static_cast<size_t>(threads))));
+	switch (strategy)
+	{
+	case ParallelismStrategy::IMAGE_LEVEL:
+		plan.imageThreads = images;
+		plan.pixelThreads = 1;
+		break;
+	case ParallelismStrategy::PIXEL_LEVEL:
+		plan.imageThreads = 1;
+		plan.pixelThreads = threads;
+		break;
+	default:
+		plan.pixelThreads = min(usefulPixelThreads, threads);
+		plan.imageThreads = max(1, min(images, threads / plan.pixelThreads));
+		break;
+	}
+	return plan;
+}
+
+// Plans imageQuantity images on which a kernel keeps usefulPixelThreads threads busy: images that keep every thread
+// busy on their own run one at a time, enough images too small to split run one per thread, and anything in
+// between is nested
+BatchPlan planBatchGroup(size_t imageQuantity, int threads, int usefulPixelThreads)
+{
+	if (imageQuantity <= 1 || usefulPixelThreads >= threads)
+	{
+		return planBatch(ParallelismStrategy::PIXEL_LEVEL, imageQuantity, threads, usefulPixelThreads);
+	}
+	if (usefulPixelThreads == 1 && imageQuantity >= static_cast<size_t>(threads))
+	{
+		return planBatch(ParallelismStrategy::IMAGE_LEVEL, imageQuantity, threads, usefulPixelThreads);
+	}
+	return planBatch(ParallelismStrategy::NESTED, imageQuantity, threads, usefulPixelThreads);
+}
+
+// Images of a batch, by index, that run together with one plan
+struct BatchGroup
+{
+	vector<size_t> indexes;
+	BatchPlan plan;
+};
+
+// Groups the images by getUsefulPixelThreads() and plans every group on its own; groups run one after the other,
+// largest images first
+vector<BatchGroup> planBatch(const vector<Mat> &images, int threads)
+{
+	map<int, vector<size_t> > indexesByThreads;
+	for (size_t i = 0; i < images.size(); ++i)
+	{
+		indexesByThreads[getUsefulPixelThreads(images[i].total(), threads)].push_back(i);
+	}
+	vector<BatchGroup> groups;
+	for (auto group = indexesByThreads.rbegin(); group != indexesByThreads.rend(); ++group)
+	{
+		groups.push_back({group->second, planBatchGroup(group->second.size(), threads, group->first)});
+	}
+	return groups;
+}
+
+// A single group of every image with the given plan, to run a fixed strategy over the whole batch
+vector<BatchGroup> getSingleBatchGroup(const vector<Mat> &images, const BatchPlan &plan)
+{
+	BatchGroup group = {vector<size_t>(images.size()), plan};
+	for (size_t i = 0; i < images.size(); ++i)
+	{
+		group.indexes[i] = i;
+	}
+	return vector<BatchGroup>(1, group);
+}
+
+// Kernel run on one image with the given number of threads
+typedef function<void(Mat &, int)> ImageKernel;
+
+// Runs kernel(index, threads) on every image of the groups, each group with its plan
+void runBatchGroups(const vector<BatchGroup> &groups, const function<void(size_t, int)> &kernel)
+{
+	// Nesting is enabled only for this batch, so code that runs after it keeps the process-wide setting
+	int previousActiveLevels = omp_get_max_active_levels();
+	omp_set_max_active_levels(2);
+	for (const BatchGroup &group : groups)
+	{
+		int imageQuantity = group.indexes.size();
+#pragma omp parallel for num_threads(group.plan.imageThreads) schedule(dynamic)
+		for (int i = 0; i < imageQuantity; ++i)
+		{
+			// Kernels that do not take a thread count use the default of the calling thread
+			omp_set_num_threads(group.plan.pixelThreads);
+			kernel(group.indexes[i], group.plan.pixelThreads);
+		}
+	}
+	omp_set_max_active_levels(previousActiveLevels);
+}
+
+void runBatch(vector<Mat> &images, ImageKernel kernel, const vector<BatchGroup> &groups)
+{
+	runBatchGroups(groups, [&images, &kernel](size_t index, int threads) { kernel(images[index], threads); });
+}
+
+// The strategy and thread columns hold one value per group, joined by '+'
+vector<string> getSchedulingBenchmarkRow(const string &workload, const vector<Mat> &images, unsigned int threads, const vector<BatchGroup> &groups, const string &prefix, const TimingStatistics &statistics)
+{
+	size_t numberOfPixels = 0;
+	for (size_t i = 0; i < images.size(); ++i)
+	{
+		numberOfPixels += images[i].total();
+	}
+	string strategy = prefix, imageThreads, pixelThreads;
+	for (size_t g = 0; g < groups.size(); ++g)
+	{
+		string separator = g == 0 ? "" : "+";
+		strategy += separator + parseParallelismStrategy(groups[g].plan.strategy);
+		imageThreads += separator + to_string(groups[g].plan.imageThreads);
+		pixelThreads += separator + to_string(groups[g].plan.pixelThreads);
+	}
+	return {workload, to_string(images.size()), to_string(numberOfPixels), to_string(threads), strategy, imageThreads, pixelThreads, formatBenchmarkNumber(statistics.median)};
+}
+
+// Measures every strategy over the whole batch and the automatic plan, recorded as "auto:<strategy of each group>",
+// for every thread count of the config. Each repetition runs on fresh copies of the images, made outside the timer.
+void testScheduling(const BenchmarkConfig &config, string workload, const vector<Mat> &images, ImageKernel kernel, BenchmarkReport &report)
+{
+	for (unsigned int threads : config.threadCounts)
+	{
+		vector<Mat> batch;
+		vector<BatchGroup> automaticGroups = planBatch(images, threads);
+		int usefulPixelThreads = max(1, static_cast<int>(threads) / 2);
+		for (const BatchGroup &group : automaticGroups)
+		{
+			if (group.plan.strategy == ParallelismStrategy::NESTED)
+			{
+				usefulPixelThreads = group.plan.pixelThreads;
+			}
+		}
+		for (size_t s = 0; s <= AllParallelismStrategies.size(); ++s)
+		{
+			bool automatic = s == AllParallelismStrategies.size();
+			vector<BatchGroup> groups = automatic ? automaticGroups : getSingleBatchGroup(images, planBatch(AllParallelismStrategies[s], images.size(), threads, usefulPixelThreads));
+			string prefix = automatic ? "auto:" : "";
+			cout << "Running " << workload << " on " << images.size() << " images using " << threads << " threads with strategy " << prefix << (automatic ? "per size group" : parseParallelismStrategy(groups[0].plan.strategy)) << endl;
+			TimingStatistics statistics = measure(config, [&]() { runBatch(batch, kernel, groups); }, [&]() {
+				batch.clear();
+				for (size_t i = 0; i < images.size(); ++i)
+				{
+					batch.push_back(images[i].clone());
+				}
+			});
+			writeBenchmarkResult(report, getSchedulingBenchmarkRow(workload, images, threads, groups, prefix, statistics), BenchmarkStage::COMPUTE, statistics);
+		}
+	}
+}
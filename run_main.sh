@@ -1 +1 @@
-g++ -o main main.cpp -I/usr/include/opencv4 -lopencv_core -lopencv_imgcodecs -lopencv_highgui -lopencv_imgproc -lopencv_features2d -lopencv_calib3d -lopencv_videoio -std=c++11 -fopenmp && ./main
+(cd kernels && sh build_kernels.sh) && g++ -o main main.cpp -Lkernels -limagekernels -I/usr/include/opencv4 -lopencv_core -lopencv_imgcodecs -lopencv_highgui -lopencv_imgproc -lopencv_features2d -lopencv_calib3d -lopencv_videoio -std=c++11 -O2 -fopenmp && ./main
\ No newline at end of file
@@ -0,0 +1,969 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <omp.h>
+#include <opencv2/opencv.hpp>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+#include "../benchmark/benchmark.hpp"
+#include "../cache/image_cache.hpp"
+#include "../parallel/execution.hpp"
+#include "../trace/trace.hpp"
+
+using namespace std;
+using namespace cv;
+
+// ------------------------------------------------------
+// Resident service
+
+/*
+./main serve [socket path] keeps the process alive and runs jobs as they arrive, so process startup, the OpenMP
+runtime, the thread pool, the codecs and the image buffers are paid for once instead of on every run. A job is a
+JSON object on one line (NDJSON), read from stdin or from any client of a Unix domain socket. Every job gets one
+response line on the stream it came from, in the order its jobs arrived on that stream:
+
+    {"id": "1", "operation": "filter", "input": "in.jpg", "output": "out.jpg", "contrast": -1, "width": 650, "height": 600}
+    {"id": "2", "operation": "filter", "filter": "gaussian_blur", "sigma": 2, "input": "in.jpg", "output": "blurred.png"}
+    {"id": "3", "operation": "compress", "input": "in.tiff", "output": "out.cimg", "rate": "medium"}
+    {"id": "4", "operation": "embed", "container": "in.jpg", "payload": "secret.bin", "output": "container.png", "bits": 1}
+    {"id": "5", "operation": "extract", "container": "container.png", "output": "secret.bin"}
+
+    {"id": "1", "operation": "filter", "status": "ok", "time": 0.0042}
+    {"id": "4", "operation": "embed", "status": "error", "error": "A bigger container or smaller info is needed."}
+
+Jobs that arrive within SERVICE_BATCH_WINDOW_MS of the first one run as a batch on the thread pool: inputs are
+decoded in parallel, the jobs are computed with the plan planBatch() of scheduler.cpp gives their images (small
+images one per thread, large ones with the threads their kernel can keep busy), and outputs are encoded in parallel. Inputs go through the decoded image cache, and
+every other image buffer comes from a pool that keeps freed buffers for the next jobs.
+This file is included by main.cpp after the filter, compression, steganography and scheduling modules, which it uses.
+*/
+
+const string SERVICE_COMMAND = "serve";
+const size_t SERVICE_MAX_BATCH_JOBS = 64;
+const double SERVICE_BATCH_WINDOW_MS = 2.0;
+// Bytes of freed image buffers kept for later jobs
+const size_t SERVICE_BUFFER_POOL_CAPACITY = size_t(512) << 20;
+const size_t SERVICE_READ_SIZE = 1 << 16;
+// Bytes of responses a client may leave unread before it is dropped
+const size_t SERVICE_MAX_PENDING_RESPONSE_BYTES = 1 << 20;
+const int SERVICE_LISTEN_BACKLOG = 16;
+
+enum class ServiceOperation
+{
+	FILTER,
+	COMPRESS,
+	EMBED,
+	EXTRACT
+};
+
+const vector<ServiceOperation> AllServiceOperations = {ServiceOperation::FILTER, ServiceOperation::COMPRESS, ServiceOperation::EMBED, ServiceOperation::EXTRACT};
+
+string parseServiceOperation(ServiceOperation operation)
+{
+	switch (operation)
+	{
+	case ServiceOperation::FILTER:
+		return "filter";
+	case ServiceOperation::COMPRESS:
+		return "compress";
+	case ServiceOperation::EMBED:
+		return "embed";
+	case ServiceOperation::EXTRACT:
+		return "extract";
+	default:
+		return "unknown";
+	}
+}
+
+// Looks an operation up by the name parseServiceOperation() gives it; returns false for unknown names
+bool findServiceOperation(const string &name, ServiceOperation &operation)
+{
+	for (ServiceOperation candidate : AllServiceOperations)
+	{
+		if (parseServiceOperation(candidate) == name)
+		{
+			operation = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+// ------------------------------------------------------
+// Image buffer pool
+
+// Keeps freed image buffers by size and hands them to the next Mat of the same size, so a stream of jobs on
+// images of similar sizes stops allocating, and page-faulting fresh memory, after the first batch. Mats are
+// reference counted and outlive the call that made them, so buffers are recycled one by one rather than
+// reset together like an arena. Freed buffers beyond capacity bytes are released.
+class PooledMatAllocator : public MatAllocator
+{
+public:
+	explicit PooledMatAllocator(size_t capacity) : capacity(capacity), pooledBytes(0) {}
+
+	~PooledMatAllocator()
+	{
+		for (auto &buffers : freeBuffers)
+		{
+			for (uchar *buffer : buffers.second)
+			{
+				fastFree(buffer);
+			}
+		}
+	}
+
+	UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step, AccessFlag flags, UMatUsageFlags usageFlags) const override
+	{
+		if (data)
+		{
+			return Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+		}
+		size_t total = CV_ELEM_SIZE(type);
+		for (int i = dims - 1; i >= 0; --i)
+		{
+			if (step)
+			{
+				step[i] = total;
+			}
+			total *= sizes[i];
+		}
+		UMatData *u = new UMatData(this);
+		u->data = u->origdata = takeBuffer(total);
+		u->size = total;
+		return u;
+	}
+
+	bool allocate(UMatData *u, AccessFlag flags, UMatUsageFlags usageFlags) const override
+	{
+		return u != nullptr;
+	}
+
+	void deallocate(UMatData *u) const override
+	{
+		if (!u)
+		{
+			return;
+		}
+		returnBuffer(u->origdata, u->size);
+		delete u;
+	}
+
+private:
+	uchar *takeBuffer(size_t size) const
+	{
+		{
+			lock_guard<mutex> lock(poolMutex);
+			auto buffers = freeBuffers.find(size);
+			if (buffers != freeBuffers.end() && !buffers->second.empty())
+			{
+				uchar *buffer = buffers->second.back();
+				buffers->second.pop_back();
+				pooledBytes -= size;
+				return buffer;
+			}
+		}
+		return static_cast<uchar *>(fastMalloc(size));
+	}
+
+	void returnBuffer(uchar *buffer, size_t size) const
+	{
+		{
+			lock_guard<mutex> lock(poolMutex);
+			if (pooledBytes + size <= capacity)
+			{
+				freeBuffers[size].push_back(buffer);
+				pooledBytes += size;
+				return;
+			}
+		}
+		fastFree(buffer);
+	}
+
+	size_t capacity;
+	mutable mutex poolMutex;
+	mutable map<size_t, vector<uchar *> > freeBuffers;
+	mutable size_t pooledBytes;
+};
+
+// ------------------------------------------------------
+// Jobs
+
+// Parses a flat JSON object whose values are strings, numbers, booleans or null into fields; numbers keep their
+// text. Returns false, with error set, for anything else.
+bool parseJsonObject(const string &text, map<string, string> &fields, string &error)
+{
+	size_t i = 0;
+	auto skipWhitespace = [&]() {
+		while (i < text.size() && isspace(static_cast<unsigned char>(text[i])))
+		{
+			++i;
+		}
+	};
+	auto parseString = [&](string &value) {
+		value.clear();
+		for (++i; i < text.size() && text[i] != '"'; ++i)
+		{
+			if (text[i] != '\\')
+			{
+				value += text[i];
+				continue;
+			}
+			if (++i == text.size())
+			{
+				return false;
+			}
+			switch (text[i])
+			{
+			case 'b':
+				value += '\b';
+				break;
+			case 'f':
+				value += '\f';
+				break;
+			case 'n':
+				value += '\n';
+				break;
+			case 'r':
+				value += '\r';
+				break;
+			case 't':
+				value += '\t';
+				break;
+			case 'u':
+			{
+				if (i + 4 >= text.size())
+				{
+					return false;
+				}
+				unsigned long code = strtoul(text.substr(i + 1, 4).c_str(), nullptr, 16);
+				i += 4;
+				// UTF-8 encoding of a code point of the Basic Multilingual Plane
+				if (code < 0x80)
+				{
+					value += static_cast<char>(code);
+				}
+				else if (code < 0x800)
+				{
+					value += static_cast<char>(0xC0 | (code >> 6));
+					value += static_cast<char>(0x80 | (code & 0x3F));
+				}
+				else
+				{
+					value += static_cast<char>(0xE0 | (code >> 12));
+					value += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+					value += static_cast<char>(0x80 | (code & 0x3F));
+				}
+				break;
+			}
+			default:
+				value += text[i];
+			}
+		}
+		if (i == text.size())
+		{
+			return false;
+		}
+		++i;
+		return true;
+	};
+
+	skipWhitespace();
+	if (i == text.size() || text[i] != '{')
+	{
+		error = "A job must be a JSON object";
+		return false;
+	}
+	++i;
+	skipWhitespace();
+	if (i < text.size() && text[i] == '}')
+	{
+		++i;
+	}
+	else
+	{
+		while (true)
+		{
+			string name, value;
+			skipWhitespace();
+			if (i == text.size() || text[i] != '"' || !parseString(name))
+			{
+				error = "Expected a quoted field name";
+				return false;
+			}
+			skipWhitespace();
+			if (i == text.size() || text[i] != ':')
+			{
+				error = "Expected ':' after \"" + name + "\"";
+				return false;
+			}
+			++i;
+			skipWhitespace();
+			if (i < text.size() && text[i] == '"')
+			{
+				if (!parseString(value))
+				{
+					error = "Unterminated string in \"" + name + "\"";
+					return false;
+				}
+			}
+			else
+			{
+				size_t end = text.find_first_of(",} \t\r\n", i);
+				value = text.substr(i, end == string::npos ? string::npos : end - i);
+				char *numberEnd = nullptr;
+				strtod(value.c_str(), &numberEnd);
+				if (value.empty() || (*numberEnd != '\0' && value != "true" && value != "false" && value != "null"))
+				{
+					error = "Only strings, numbers, booleans and null are accepted, in \"" + name + "\"";
+					return false;
+				}
+				i = end == string::npos ? text.size() : end;
+			}
+			fields[name] = value;
+			skipWhitespace();
+			if (i < text.size() && text[i] == ',')
+			{
+				++i;
+				continue;
+			}
+			if (i < text.size() && text[i] == '}')
+			{
+				++i;
+				break;
+			}
+			error = "Expected ',' or '}' after \"" + name + "\"";
+			return false;
+		}
+	}
+	skipWhitespace();
+	if (i != text.size())
+	{
+		error = "Unexpected text after the job";
+		return false;
+	}
+	return true;
+}
+
+struct ServiceJob
+{
+	size_t connection;
+	map<string, string> fields;
+	ServiceOperation operation;
+	// Set by the first step that fails; the remaining steps are skipped
+	string error;
+	Mat image;
+	Mat result;
+	CompressedImage compressedImage;
+	// Scratch buffer of the job's slot in the batch, kept between batches
+	vector<unsigned char> *payload;
+	double time;
+};
+
+string getJobField(const ServiceJob &job, const string &name, const string &defaultValue = "")
+{
+	auto field = job.fields.find(name);
+	return field == job.fields.end() ? defaultValue : field->second;
+}
+
+double getJobNumber(const ServiceJob &job, const string &name, double defaultValue)
+{
+	auto field = job.fields.find(name);
+	return field == job.fields.end() ? defaultValue : atof(field->second.c_str());
+}
+
+bool hasSuffix(const string &text, const string &suffix)
+{
+	return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Every operation reads one image, from "input" or, for the steganography, from "container"
+string getJobImagePath(const ServiceJob &job)
+{
+	return getJobField(job, job.operation == ServiceOperation::FILTER || job.operation == ServiceOperation::COMPRESS ? "input" : "container");
+}
+
+bool parseServiceJob(const string &line, ServiceJob &job)
+{
+	if (!parseJsonObject(line, job.fields, job.error))
+	{
+		return false;
+	}
+	if (!findServiceOperation(getJobField(job, "operation"), job.operation))
+	{
+		job.error = "Unknown operation \"" + getJobField(job, "operation") + "\"";
+		return false;
+	}
+	vector<string> required = {job.operation == ServiceOperation::FILTER || job.operation == ServiceOperation::COMPRESS ? "input" : "container", "output"};
+	if (job.operation == ServiceOperation::EMBED)
+	{
+		required.push_back("payload");
+	}
+	for (const string &name : required)
+	{
+		if (getJobField(job, name).empty())
+		{
+			job.error = "Missing \"" + name + "\"";
+			return false;
+		}
+	}
+	return true;
+}
+
+bool readServiceFile(const string &path, vector<unsigned char> &bytes)
+{
+	ifstream file(path, ios::binary | ios::ate);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	bytes.resize(static_cast<size_t>(file.tellg()));
+	file.seekg(0);
+	return file.read(reinterpret_cast<char *>(bytes.data()), bytes.size()).good() || bytes.empty();
+}
+
+void readServiceJobInput(ServiceJob &job, int threads)
+{
+	string path = getJobImagePath(job);
+	job.image = readCachedImage(path);
+	if (job.image.empty())
+	{
+		job.error = "Error reading image " + path;
+		return;
+	}
+	if (job.operation == ServiceOperation::EMBED && !readServiceFile(getJobField(job, "payload"), *job.payload))
+	{
+		job.error = "Error reading file " + getJobField(job, "payload");
+	}
+}
+
+void computeServiceJob(ServiceJob &job, int threads)
+{
+	size_t pixelGroupQuantity, pixelGroupQuantityPerThread;
+	switch (job.operation)
+	{
+	case ServiceOperation::FILTER:
+	{
+		// applyContrast() takes its threads from OpenMP; inside a pool worker it runs on that worker alone
+		string filter = getJobField(job, "filter", "contrast");
+		if (filter == "contrast")
+		{
+			job.result = applyContrast(job.image, getJobNumber(job, "contrast", -1), getJobNumber(job, "width", job.image.cols), getJobNumber(job, "height", job.image.rows));
+		}
+		else if (filter == "gaussian_blur")
+		{
+			job.result = gaussianBlur(job.image, getJobNumber(job, "sigma", 2.0), threads);
+		}
+		else if (filter == "auto_contrast")
+		{
+			job.result = applyAutoContrast(job.image, getJobField(job, "mode") == "equalize" ? AutoContrastMode::EQUALIZE : AutoContrastMode::STRETCH, threads);
+		}
+		else if (filter == "sobel")
+		{
+			job.result = sobelEdges(job.image, threads);
+		}
+		else
+		{
+			job.error = "Unknown filter \"" + filter + "\", expected contrast, gaussian_blur, auto_contrast or sobel";
+		}
+		break;
+	}
+	case ServiceOperation::COMPRESS:
+	{
+		ImageCompressionRate rate;
+		if (!findImageCompressionRate(getJobField(job, "rate", "medium"), rate))
+		{
+			job.error = "Unknown rate \"" + getJobField(job, "rate") + "\", expected low, medium, high or very_high";
+		}
+		else if (hasSuffix(getJobField(job, "output"), COMPRESSED_IMAGE_EXTENSION))
+		{
+			job.compressedImage = compressImageGridThreads(job.image, rate, pixelGroupQuantity, pixelGroupQuantityPerThread, threads);
+		}
+		else
+		{
+			job.result = compressImageThreads(job.image, rate, pixelGroupQuantity, pixelGroupQuantityPerThread, threads);
+		}
+		break;
+	}
+	case ServiceOperation::EMBED:
+	{
+		unsigned bitsPerChannel = getJobNumber(job, "bits", DEFAULT_BITS_PER_CHANNEL);
+		if (bitsPerChannel < 1 || bitsPerChannel > MAX_BITS_PER_CHANNEL)
+		{
+			job.error = "\"bits\" must be between 1 and " + to_string(MAX_BITS_PER_CHANNEL);
+			break;
+		}
+		if (!job.image.isContinuous())
+		{
+			job.image = job.image.clone();
+		}
+		MappedPayload payload = {job.payload->data(), job.payload->size()};
+		parallelEmbed(job.image, payload, threads, bitsPerChannel);
+		job.result = job.image;
+		break;
+	}
+	case ServiceOperation::EXTRACT:
+		if (!parallelExtract(job.image, *job.payload, threads))
+		{
+			job.error = "The container holds no valid embedded info";
+		}
+		break;
+	}
+}
+
+void writeServiceJobOutput(ServiceJob &job, int threads)
+{
+	string path = getJobField(job, "output");
+	bool written;
+	if (job.operation == ServiceOperation::EXTRACT)
+	{
+		ofstream file(path, ios::binary | ios::trunc);
+		written = file.write(reinterpret_cast<const char *>(job.payload->data()), job.payload->size()).good();
+	}
+	else if (job.operation == ServiceOperation::COMPRESS && hasSuffix(path, COMPRESSED_IMAGE_EXTENSION))
+	{
+		written = saveCompressedImage(path, job.compressedImage);
+	}
+	else if (job.operation == ServiceOperation::EMBED && !hasSuffix(path, ".png"))
+	{
+		// A lossy format recompresses the channels and destroys the embedded bits
+		job.error = "Containers are saved as PNG, \"output\" must end in .png";
+		return;
+	}
+	else
+	{
+		written = imwrite(path, job.result);
+	}
+	if (!written)
+	{
+		job.error = "Error writing " + path;
+	}
+	// The buffers go back to the pool as soon as the job is done with them
+	job.image.release();
+	job.result.release();
+	job.compressedImage.grid.release();
+}
+
+// Runs one step of a job that has not failed, adds its time, and turns exceptions (planShards() throws when
+// a payload does not fit) into the job's error
+void runServiceStep(ServiceJob &job, const function<void(ServiceJob &, int)> &step, int threads)
+{
+	if (!job.error.empty())
+	{
+		return;
+	}
+	double startTime = omp_get_wtime();
+	try
+	{
+		step(job, threads);
+	}
+	catch (const exception &exception)
+	{
+		job.error = exception.what();
+	}
+	job.time += omp_get_wtime() - startTime;
+}
+
+string formatServiceResponse(const ServiceJob &job)
+{
+	string response = "{\"id\": " + quoteJsonString(getJobField(job, "id")) + ", \"operation\": " + quoteJsonString(getJobField(job, "operation"));
+	if (!job.error.empty())
+	{
+		return response + ", \"status\": \"error\", \"error\": " + quoteJsonString(job.error) + "}\n";
+	}
+	response += ", \"status\": \"ok\", \"time\": " + formatBenchmarkNumber(job.time);
+	if (job.operation == ServiceOperation::EXTRACT)
+	{
+		response += ", \"bytes\": " + to_string(job.payload->size());
+	}
+	return response + "}\n";
+}
+
+// ------------------------------------------------------
+// Batches and connections
+
+// A stream jobs arrive on and responses go back on: stdin and stdout, or both ends of a socket client.
+// Responses wait in responses until the output can take them, so a client that stops reading only fills its own
+// buffer; socket clients are non-blocking. closed is set when the input ends, dropped when the client is cut off.
+struct ServiceConnection
+{
+	int input;
+	int output;
+	string buffer;
+	string responses;
+	bool closed;
+	bool dropped;
+};
+
+ServiceConnection createServiceConnection(int input, int output)
+{
+	ServiceConnection connection = {input, output, "", "", false, false};
+	return connection;
+}
+
+void dropServiceConnection(ServiceConnection &connection, const string &reason)
+{
+	cerr << "Dropping client: " << reason << endl;
+	connection.closed = true;
+	connection.dropped = true;
+	connection.buffer.clear();
+	connection.responses.clear();
+}
+
+// Writes as much of the waiting responses as the output takes without blocking
+void flushServiceConnection(ServiceConnection &connection)
+{
+	size_t written = 0;
+	while (written < connection.responses.size())
+	{
+		ssize_t bytesWritten = write(connection.output, connection.responses.data() + written, connection.responses.size() - written);
+		if (bytesWritten < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (bytesWritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			break;
+		}
+		if (bytesWritten <= 0)
+		{
+			dropServiceConnection(connection, strerror(errno));
+			return;
+		}
+		written += bytesWritten;
+	}
+	connection.responses.erase(0, written);
+}
+
+struct ServiceState
+{
+	int threads;
+	// One payload buffer per job slot of a batch, reused by every batch
+	vector<vector<unsigned char> > payloads;
+};
+
+// A line taken from a connection, not yet run
+struct ServiceLine
+{
+	size_t connection;
+	string text;
+};
+
+void runServiceBatch(const vector<ServiceLine> &lines, vector<ServiceConnection> &connections, ServiceState &state)
+{
+	TraceRegion trace("runServiceBatch", state.threads);
+	vector<ServiceJob> jobs(lines.size());
+	if (state.payloads.size() < jobs.size())
+	{
+		state.payloads.resize(jobs.size());
+	}
+	for (size_t i = 0; i < jobs.size(); ++i)
+	{
+		jobs[i].connection = lines[i].connection;
+		jobs[i].payload = &state.payloads[i];
+		jobs[i].time = 0.0;
+		parseServiceJob(lines[i].text, jobs[i]);
+	}
+
+	parallelFor(0, static_cast<int>(jobs.size()), state.threads, [&jobs](int begin, int end, int worker) {
+		for (int i = begin; i < end; ++i)
+		{
+			runServiceStep(jobs[i], readServiceJobInput, 1);
+		}
+	}, 1);
+
+	vector<size_t> readJobs;
+	vector<Mat> images;
+	for (size_t i = 0; i < jobs.size(); ++i)
+	{
+		if (jobs[i].error.empty())
+		{
+			readJobs.push_back(i);
+			images.push_back(jobs[i].image);
+		}
+	}
+	runBatchGroups(planBatch(images, state.threads), [&jobs, &readJobs](size_t index, int threads) {
+		runServiceStep(jobs[readJobs[index]], computeServiceJob, threads);
+	});
+	images.clear();
+
+	parallelFor(0, static_cast<int>(jobs.size()), state.threads, [&jobs](int begin, int end, int worker) {
+		for (int i = begin; i < end; ++i)
+		{
+			runServiceStep(jobs[i], writeServiceJobOutput, 1);
+		}
+	}, 1);
+
+	for (const ServiceJob &job : jobs)
+	{
+		ServiceConnection &connection = connections[job.connection];
+		if (connection.dropped)
+		{
+			continue;
+		}
+		connection.responses += formatServiceResponse(job);
+		if (connection.responses.size() > SERVICE_MAX_PENDING_RESPONSE_BYTES)
+		{
+			dropServiceConnection(connection, "it stopped reading its responses");
+		}
+	}
+	for (ServiceConnection &connection : connections)
+	{
+		if (!connection.responses.empty())
+		{
+			flushServiceConnection(connection);
+		}
+	}
+}
+
+// Whether the connection's buffer holds a line to run; the last line of a closed connection needs no newline
+bool hasServiceLine(const ServiceConnection &connection)
+{
+	return !connection.dropped && (connection.buffer.find('\n') != string::npos || (connection.closed && !connection.buffer.empty()));
+}
+
+// Moves complete lines from the connections' buffers to lines, up to SERVICE_MAX_BATCH_JOBS in total, one line per
+// connection in turn so a client that sends many jobs at once does not hold the others back. Blank lines are skipped.
+void takeServiceLines(vector<ServiceConnection> &connections, vector<ServiceLine> &lines)
+{
+	bool taken = true;
+	while (taken && lines.size() < SERVICE_MAX_BATCH_JOBS)
+	{
+		taken = false;
+		for (size_t c = 0; c < connections.size() && lines.size() < SERVICE_MAX_BATCH_JOBS; ++c)
+		{
+			ServiceConnection &connection = connections[c];
+			if (!hasServiceLine(connection))
+			{
+				continue;
+			}
+			size_t end = connection.buffer.find('\n');
+			string text = connection.buffer.substr(0, end);
+			connection.buffer.erase(0, end == string::npos ? string::npos : end + 1);
+			if (text.find_first_not_of(" \t\r") != string::npos)
+			{
+				lines.push_back({c, text});
+			}
+			taken = true;
+		}
+	}
+}
+
+// Appends what is waiting on the connection to its buffer; returns false once the other end has closed it
+bool readServiceConnection(ServiceConnection &connection)
+{
+	char chunk[SERVICE_READ_SIZE];
+	ssize_t bytesRead = read(connection.input, chunk, sizeof(chunk));
+	if (bytesRead < 0 && (errno == EINTR || errno == EAGAIN))
+	{
+		return true;
+	}
+	if (bytesRead <= 0)
+	{
+		return false;
+	}
+	connection.buffer.append(chunk, bytesRead);
+	return true;
+}
+
+// Listens on a Unix domain socket at path, replacing a socket file left behind by a previous run
+int openServiceSocket(const string &path)
+{
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+	{
+		cerr << "Error: The socket path " << path << " is too long" << endl;
+		return -1;
+	}
+	strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0)
+	{
+		perror("Failed to create socket");
+		return -1;
+	}
+	unlink(path.c_str());
+	if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener, SERVICE_LISTEN_BACKLOG) != 0)
+	{
+		perror("Failed to listen on socket");
+		close(listener);
+		return -1;
+	}
+	return listener;
+}
+
+// Starts the OpenMP runtime, the pool workers and the image codecs before the first job arrives
+void warmUpService(int threads)
+{
+#pragma omp parallel num_threads(threads)
+	{
+	}
+	parallelFor(0, threads, threads, [](int begin, int end, int worker) {}, 1);
+	Mat image(8, 8, CV_8UC3, Scalar::all(0));
+	vector<uchar> encoded;
+	for (const char *extension : {".png", ".jpg", ".tiff"})
+	{
+		imencode(extension, image, encoded);
+		imdecode(encoded, IMREAD_COLOR);
+	}
+}
+
+// Serves jobs from stdin until it ends or, with a socket path, from socket clients until the process is stopped
+int runService(const string &socketPath)
+{
+	int listener = -1;
+	if (!socketPath.empty())
+	{
+		listener = openServiceSocket(socketPath);
+		if (listener < 0)
+		{
+			return EXIT_FAILURE;
+		}
+		cerr << "Listening on " << socketPath << endl;
+	}
+	// A client that leaves before its responses are written must not take the service down with it
+	signal(SIGPIPE, SIG_IGN);
+	vector<ServiceConnection> connections;
+	if (listener < 0)
+	{
+		// stdout stays blocking: it belongs to the only client, so a reader that stalls only stalls itself
+		connections.push_back(createServiceConnection(STDIN_FILENO, STDOUT_FILENO));
+	}
+
+	setExecutionBackend(ExecutionBackend::THREAD_POOL);
+	PooledMatAllocator allocator(SERVICE_BUFFER_POOL_CAPACITY);
+	MatAllocator *defaultAllocator = Mat::getDefaultAllocator();
+	Mat::setDefaultAllocator(&allocator);
+	ServiceState state;
+	state.threads = omp_get_max_threads();
+	warmUpService(state.threads);
+
+	vector<ServiceLine> lines;
+	double batchStart = 0.0;
+	while (true)
+	{
+		// Connections are only dropped between batches, since pending lines refer to them by index
+		if (lines.empty())
+		{
+			for (size_t c = connections.size(); c-- > 0;)
+			{
+				if (connections[c].dropped || (connections[c].closed && connections[c].buffer.empty() && connections[c].responses.empty()))
+				{
+					if (connections[c].input != STDIN_FILENO)
+					{
+						close(connections[c].input);
+					}
+					connections.erase(connections.begin() + c);
+				}
+			}
+			if (listener < 0 && connections.empty())
+			{
+				break;
+			}
+		}
+
+		vector<pollfd> descriptors;
+		vector<size_t> descriptorConnections;
+		if (listener >= 0)
+		{
+			descriptors.push_back({listener, POLLIN, 0});
+			descriptorConnections.push_back(connections.size());
+		}
+		for (size_t c = 0; c < connections.size(); ++c)
+		{
+			if (!connections[c].closed)
+			{
+				descriptors.push_back({connections[c].input, POLLIN, 0});
+				descriptorConnections.push_back(c);
+			}
+			if (!connections[c].dropped && !connections[c].responses.empty())
+			{
+				descriptors.push_back({connections[c].output, POLLOUT, 0});
+				descriptorConnections.push_back(c);
+			}
+		}
+		// Lines already buffered run without waiting for more input
+		int timeout = -1;
+		for (const ServiceConnection &connection : connections)
+		{
+			if (hasServiceLine(connection))
+			{
+				timeout = 0;
+			}
+		}
+		if (timeout < 0 && !lines.empty())
+		{
+			timeout = max(0, static_cast<int>(SERVICE_BATCH_WINDOW_MS - (omp_get_wtime() - batchStart) * 1000.0));
+		}
+		int ready = poll(descriptors.data(), descriptors.size(), timeout);
+		if (ready < 0 && errno != EINTR)
+		{
+			perror("Failed to poll");
+			break;
+		}
+
+		for (size_t d = 0; ready > 0 && d < descriptors.size(); ++d)
+		{
+			if (!(descriptors[d].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)))
+			{
+				continue;
+			}
+			if (descriptors[d].fd == listener)
+			{
+				int client = accept(listener, nullptr, nullptr);
+				if (client >= 0)
+				{
+					fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+					connections.push_back(createServiceConnection(client, client));
+				}
+				continue;
+			}
+			ServiceConnection &connection = connections[descriptorConnections[d]];
+			if (connection.dropped)
+			{
+				continue;
+			}
+			if (descriptors[d].events == POLLOUT)
+			{
+				// An output that hung up makes the write fail, which drops the client
+				flushServiceConnection(connection);
+			}
+			else if (!connection.closed)
+			{
+				connection.closed = !readServiceConnection(connection);
+			}
+		}
+
+		bool wasEmpty = lines.empty();
+		takeServiceLines(connections, lines);
+		if (wasEmpty && !lines.empty())
+		{
+			batchStart = omp_get_wtime();
+		}
+		if (!lines.empty() && (lines.size() >= SERVICE_MAX_BATCH_JOBS || (omp_get_wtime() - batchStart) * 1000.0 >= SERVICE_BATCH_WINDOW_MS))
+		{
+			runServiceBatch(lines, connections, state);
+			lines.clear();
+		}
+	}
+
+	if (listener >= 0)
+	{
+		close(listener);
+		unlink(socketPath.c_str());
+	}
+	Mat::setDefaultAllocator(defaultAllocator);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,246 @@
+/*
+Sin guarda de inclusión: kernels/kernels.cpp incluye este archivo una vez por variante (escalar, SSE4.2, AVX2,
+AVX-512), dentro del espacio de nombres de la variante y con sus macros KERNEL_*; el resto del código llama a las
+funciones a través de kernels/kernels.hpp, que elige la variante al arrancar.
+
+Núcleos para esconder bytes en los bits menos significativos (LSB) de los canales de una imagen y para
+recuperarlos. El bit j de un byte de información va en el LSB del canal j de su ventana; las ventanas de bytes
+consecutivos empiezan cada stride canales. La cabecera de los contenedores y la información con 1 bit por canal
+usan stride 8: los 8 canales de cada ventana son seguidos, sin huecos.
+Cada ventana se trata como una palabra de 64 bits, así que el trabajo se reduce a repartir 8 bits en los LSB de
+8 bytes (pdep de BMI2, o una multiplicación en las variantes sin BMI2) y a juntarlos de nuevo (pext, o otra
+multiplicación). Con stride 8, en las variantes con AVX2 se procesan 4 bytes de información (32 canales) por iteración.
+
+Con k bits por canal (k = 1..4) la información se empaqueta sin huecos: cada grupo de 8 canales seguidos guarda
+k bytes, y el bit b del grupo va en el bit b % k del canal b / k. Repartir un grupo es un pdep con la máscara de
+los k bits bajos de cada byte (0x0101..., 0x0303..., 0x0707..., 0x0F0F...).
+*/
+
+const uint64_t LSB_MASK = 0x0101010101010101ULL;
+
+// Reparte los 8 bits de byte en los LSB de los 8 bytes de la palabra: el bit j queda en el bit 0 del byte j
+inline uint64_t spreadBits(unsigned char byte)
+{
+#if defined(KERNEL_BMI2)
+    return _pdep_u64(byte, LSB_MASK);
+#else
+    // Se copia el byte en las 8 posiciones, cada posición j conserva solo su bit j, y sumar 0x7F lleva ese bit al bit 7
+    uint64_t selected = (byte * LSB_MASK) & 0x8040201008040201ULL;
+    return ((selected + 0x7F7F7F7F7F7F7F7FULL) >> 7) & LSB_MASK;
+#endif
+}
+
+// Inverso de spreadBits(): junta los LSB de los 8 bytes de la palabra en un byte
+inline unsigned char gatherBits(uint64_t word)
+{
+#if defined(KERNEL_BMI2)
+    return static_cast<unsigned char>(_pext_u64(word, LSB_MASK));
+#else
+    // La multiplicación desplaza el LSB del byte j al bit 56 + j, sin acarreos que lleguen al byte alto
+    return static_cast<unsigned char>(((word & LSB_MASK) * 0x0102040810204080ULL) >> 56);
+#endif
+}
+
+/*
+En binario, 0xFE es 11111110. Al realizar una operación AND entre este valor y otro byte,
+se garantiza que todos los bits del otro byte se conserven, excepto el bit menos significativo (LSB),
+que se establecerá en 0, para después hacerle un OR y poner el LSB que se desea. Aquí se hace para
+los 8 canales de la ventana a la vez.
+*/
+inline void embedLsbWindow(unsigned char* channels, unsigned char byte)
+{
+    uint64_t word;
+    memcpy(&word, channels, sizeof(word));
+    word = (word & ~LSB_MASK) | spreadBits(byte);
+    memcpy(channels, &word, sizeof(word));
+}
+
+inline unsigned char extractLsbWindow(const unsigned char* channels)
+{
+    uint64_t word;
+    memcpy(&word, channels, sizeof(word));
+    return gatherBits(word);
+}
+
+// Esconde count bytes de payload a partir de channels, una ventana de 8 canales cada stride canales
+void embedLsbBytes(unsigned char* channels, size_t stride, const unsigned char* payload, size_t count)
+{
+    size_t i = 0;
+#if defined(KERNEL_AVX2)
+    if (stride == 8)
+    {
+        // Cada byte de información se copia en los 8 bytes de su ventana y cada byte j se queda con su bit j
+        const __m256i broadcast = _mm256_setr_epi8(
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+        const __m256i bitMasks = _mm256_set1_epi64x(0x8040201008040201LL);
+        const __m256i lsb = _mm256_set1_epi8(1);
+        for (; i + 4 <= count; i += 4)
+        {
+            int32_t bytes;
+            memcpy(&bytes, payload + i, sizeof(bytes));
+            __m256i spread = _mm256_shuffle_epi8(_mm256_set1_epi32(bytes), broadcast);
+            __m256i bits = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(spread, bitMasks), bitMasks), lsb);
+            unsigned char* window = channels + i * 8;
+            __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(window));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(window), _mm256_or_si256(_mm256_andnot_si256(lsb, pixels), bits));
+        }
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        embedLsbWindow(channels + i * stride, payload[i]);
+    }
+}
+
+// Recupera count bytes escondidos con embedLsbBytes() con el mismo stride
+void extractLsbBytes(const unsigned char* channels, size_t stride, unsigned char* payload, size_t count)
+{
+    size_t i = 0;
+#if defined(KERNEL_AVX2)
+    if (stride == 8)
+    {
+        // Al desplazar 7 bits, el LSB de cada canal queda en su bit alto, que movemask junta en orden
+        for (; i + 4 <= count; i += 4)
+        {
+            __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(channels + i * 8));
+            int32_t bytes = _mm256_movemask_epi8(_mm256_slli_epi64(pixels, 7));
+            memcpy(payload + i, &bytes, sizeof(bytes));
+        }
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        payload[i] = extractLsbWindow(channels + i * stride);
+    }
+}
+
+// Máscara con los k bits bajos de cada byte de una palabra
+constexpr uint64_t packedLsbMask(unsigned k)
+{
+    return LSB_MASK * ((1ULL << k) - 1);
+}
+
+// Reparte los 8 * K bits de bits en los K bits bajos de los 8 bytes de la palabra
+template<unsigned K>
+inline uint64_t spreadPackedBits(uint64_t bits)
+{
+#if defined(KERNEL_BMI2)
+    return _pdep_u64(bits, packedLsbMask(K));
+#else
+    uint64_t word = 0;
+    for (unsigned j = 0; j < 8; ++j)
+    {
+        word |= ((bits >> (K * j)) & ((1u << K) - 1)) << (8 * j);
+    }
+    return word;
+#endif
+}
+
+template<unsigned K>
+inline uint64_t gatherPackedBits(uint64_t word)
+{
+#if defined(KERNEL_BMI2)
+    return _pext_u64(word, packedLsbMask(K));
+#else
+    uint64_t bits = 0;
+    for (unsigned j = 0; j < 8; ++j)
+    {
+        bits |= ((word >> (8 * j)) & ((1u << K) - 1)) << (K * j);
+    }
+    return bits;
+#endif
+}
+
+// Esconde count bytes con K bits por canal: cada K bytes ocupan 8 canales, y el último grupo incompleto solo los canales que necesita
+template<unsigned K>
+void embedKLsbBytes(unsigned char* channels, const unsigned char* payload, size_t count)
+{
+    const uint64_t mask = packedLsbMask(K);
+    size_t groups = count / K;
+    for (size_t g = 0; g < groups; ++g)
+    {
+        uint64_t bits = 0;
+        memcpy(&bits, payload + g * K, K);
+        uint64_t word;
+        memcpy(&word, channels + g * 8, sizeof(word));
+        word = (word & ~mask) | spreadPackedBits<K>(bits);
+        memcpy(channels + g * 8, &word, sizeof(word));
+    }
+
+    size_t remainder = count - groups * K;
+    if (remainder > 0)
+    {
+        uint64_t bits = 0;
+        memcpy(&bits, payload + groups * K, remainder);
+        unsigned char* group = channels + groups * 8;
+        for (size_t j = 0; j < (remainder * 8 + K - 1) / K; ++j)
+        {
+            group[j] = (group[j] & ~((1u << K) - 1)) | ((bits >> (K * j)) & ((1u << K) - 1));
+        }
+    }
+}
+
+template<unsigned K>
+void extractKLsbBytes(const unsigned char* channels, unsigned char* payload, size_t count)
+{
+    size_t groups = count / K;
+    for (size_t g = 0; g < groups; ++g)
+    {
+        uint64_t word;
+        memcpy(&word, channels + g * 8, sizeof(word));
+        uint64_t bits = gatherPackedBits<K>(word);
+        memcpy(payload + g * K, &bits, K);
+    }
+
+    size_t remainder = count - groups * K;
+    if (remainder > 0)
+    {
+        uint64_t bits = 0;
+        const unsigned char* group = channels + groups * 8;
+        for (size_t j = 0; j < (remainder * 8 + K - 1) / K; ++j)
+        {
+            bits |= static_cast<uint64_t>(group[j] & ((1u << K) - 1)) << (K * j);
+        }
+        memcpy(payload + groups * K, &bits, remainder);
+    }
+}
+
+// Elige la especialización de bitsPerChannel; con 1 bit se usa embedLsbBytes(), que tiene camino AVX2
+void embedPackedLsbBytes(unsigned char* channels, unsigned bitsPerChannel, const unsigned char* payload, size_t count)
+{
+    switch (bitsPerChannel)
+    {
+    case 1:
+        embedLsbBytes(channels, 8, payload, count);
+        break;
+    case 2:
+        embedKLsbBytes<2>(channels, payload, count);
+        break;
+    case 3:
+        embedKLsbBytes<3>(channels, payload, count);
+        break;
+    case 4:
+        embedKLsbBytes<4>(channels, payload, count);
+        break;
+    }
+}
+
+void extractPackedLsbBytes(const unsigned char* channels, unsigned bitsPerChannel, unsigned char* payload, size_t count)
+{
+    switch (bitsPerChannel)
+    {
+    case 1:
+        extractLsbBytes(channels, 8, payload, count);
+        break;
+    case 2:
+        extractKLsbBytes<2>(channels, payload, count);
+        break;
+    case 3:
+        extractKLsbBytes<3>(channels, payload, count);
+        break;
+    case 4:
+        extractKLsbBytes<4>(channels, payload, count);
+        break;
+    }
+}
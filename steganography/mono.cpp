@@ -5,12 +5,15 @@
 #include <omp.h>
 #include <vector>
 #include <cstdio>
+#include "payload.hpp"
 
 using namespace std;
 using namespace cv;
 
 const string IMAGE_PATH = "containers/mona_lisa.jpg";
 const char* INFO_TO_EMBED_PATH = "info/img.jpg";
+// El contenedor se guarda sin pérdida: un JPEG recomprime los canales y destruye los LSB
+const string RESULT_PATH = "results/mono/result.png";
 
 enum SizeUnit {
     BYTES = 1,
@@ -33,14 +36,15 @@ long getFileSizeIn(SizeUnit unit, FILE* file) {
     return size * unit;
 }
 
-void verifySizeCompatibility(FILE* file, Mat img){
+void verifySizeCompatibility(FILE* file, Mat img, unsigned bitsPerChannel){
     if (img.channels() != 3) {
         cerr << "Error: Image must be a 3-channel (RGB) image.\n";
         throw runtime_error("Image must be a 3-channel (RGB) image.");
     }
 
-    unsigned int totalBitsToStore = img.rows * img.cols * 3;
-    unsigned int fileSizeInBits = getFileSizeIn(SizeUnit::BITS, file);
+    // Cada canal guarda bitsPerChannel bits, y la cabecera va antes de la información
+    long totalBitsToStore = getPayloadCapacity(img.total() * img.channels(), bitsPerChannel) * SizeUnit::BITS;
+    long fileSizeInBits = getFileSizeIn(SizeUnit::BITS, file);
 
     if(totalBitsToStore < fileSizeInBits){
         cerr << "Error: A bigger container or smaller info is needed.\n";
@@ -48,41 +52,45 @@ void verifySizeCompatibility(FILE* file, Mat img){
     }
 }
 
-void embed(Mat& img, int row, int col, unsigned char bit, int channel) {
-    Vec3b& pixel = img.at<Vec3b>(row, col);
-
-    pixel[channel] = (pixel[channel] & ~1) | bit;
-}
-
-void readFileAndEmbed(FILE* file, Mat& img) {
-    unsigned int fileSize = getFileSizeIn(SizeUnit::BYTES, file);
-    int width = img.cols;
-    int numChannels = img.channels();
-
-    int row, col;
-    unsigned char byte;
-
-    for(unsigned int idx = 0; idx < fileSize; idx++){
-        byte = fgetc(file);
+/*
+Con 1 bit por canal, el bit j del byte idx de la información va en el LSB del canal PAYLOAD_HEADER_CHANNELS + idx * 8 + j
+de la imagen, recorriendo el buffer continuo de la imagen fila por fila; con k bits por canal cada k bytes ocupan 8
+canales seguidos. Antes de la información va la cabecera con la longitud, k y la suma Adler-32.
+*/
+void readFileAndEmbed(FILE* file, Mat& img, unsigned bitsPerChannel) {
+    if (!img.isContinuous()) {
+        img = img.clone();
+    }
+    size_t fileSize = getFileSizeIn(SizeUnit::BYTES, file);
+    size_t capacity = getPayloadCapacity(img.total() * img.channels(), bitsPerChannel);
 
-        if(byte == EOF) break;
+    vector<unsigned char> payload(min(fileSize, capacity));
+    size_t bytesRead = fread(payload.data(), 1, payload.size(), file);
+    PayloadHeader header = createPayloadHeader(bitsPerChannel, bytesRead, adler32(payload.data(), bytesRead));
+    embedPayloadBytes(img.data, header, payload.data(), 0, bytesRead);
+    writePayloadHeader(img.data, header);
 
-        for(int bitPos = 0; bitPos < 8; bitPos++) {
-            unsigned char bit = (byte >> bitPos) & 1;
-            int pixelIdx = idx * 8 + bitPos;
-            row = pixelIdx / (width * numChannels);
-            col = (pixelIdx % (width * numChannels)) / numChannels;
-            int channel = (pixelIdx % (width * numChannels)) % numChannels;
+    imwrite(RESULT_PATH, img);
+}
 
-            if(row >= img.rows) break;
-            embed(img, row, col, bit, channel);
-        }
+// Recupera la información de un contenedor y comprueba su suma Adler-32
+bool extractFromImage(const Mat& img, vector<unsigned char>& payload) {
+    PayloadHeader header;
+    if (!img.isContinuous() || !readPayloadHeader(img.data, img.total() * img.channels(), header) || header.shardCount != 1) {
+        return false;
     }
-
-    imwrite("results/mono/result.jpg", img);
+    payload.resize(header.length);
+    extractPayloadBytes(img.data, header, payload.data(), 0, payload.size());
+    return adler32(payload.data(), payload.size()) == header.checksum;
 }
 
+// ./mono [k] esconde la información con k = 1..4 bits por canal (1 por defecto)
 int main(int argc, char** argv){
+    unsigned bitsPerChannel = argc > 1 ? atoi(argv[1]) : 1;
+    if (bitsPerChannel < 1 || bitsPerChannel > MAX_BITS_PER_CHANNEL) {
+        cerr << "Error: The bits per channel must be between 1 and " << MAX_BITS_PER_CHANNEL << endl;
+        return -1;
+    }
     FILE* file = fopen(INFO_TO_EMBED_PATH, "rb");
     Mat img = imread(IMAGE_PATH);
 
@@ -96,8 +104,15 @@ int main(int argc, char** argv){
         return -1;
     }
 
-    verifySizeCompatibility(file, img);
-    readFileAndEmbed(file, img);
+    verifySizeCompatibility(file, img, bitsPerChannel);
+    readFileAndEmbed(file, img, bitsPerChannel);
+
+    vector<unsigned char> payload;
+    if (!extractFromImage(imread(RESULT_PATH), payload)) {
+        cerr << "Error: The info embedded in " << RESULT_PATH << " could not be recovered." << endl;
+        fclose(file);
+        return -1;
+    }
 
     fclose(file);
     return 0;
@@ -5,161 +5,453 @@
 #include <omp.h>
 #include <vector>
 #include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../benchmark/benchmark.hpp"
+#include "../cache/image_cache.hpp"
+#include "../parallel/execution.hpp"
+#include "payload.hpp"
 
-//g++ -fopenmp -I/usr/include/opencv4 -L/usr/lib -lopencv_core -lopencv_imgcodecs -lopencv_highgui multi.cpp -o multi && ./multi
+//sh runMulti.sh (builds ../kernels/libimagekernels.a first)
 
 using namespace std;
 using namespace cv;
 
-struct ByteData;
-
 const string IMAGE_PATH = "containers/mona_lisa.jpg";
 const char* INFO_TO_EMBED_PATH = "info/img.jpg";
 
-unsigned char* mainBuffer;
-int* threadsStartPositionsBuffer;
-int* threadsEndPositionsBuffer;
-ByteData* byteDataBuffer;
+// La información se empaqueta con k bits por canal (ver payload.hpp); más bits tocan menos canales por byte
+const unsigned DEFAULT_BITS_PER_CHANNEL = 1;
+// El contenedor se guarda sin pérdida: un JPEG recomprime los canales y destruye los LSB
+const string STEGANOGRAPHY_RESULT_PATH = "results/multi/result.png";
+const string STEGANOGRAPHY_SHARD_PATH = "results/multi/shard_";
+const string STEGANOGRAPHY_BENCHMARK_COLUMNS = "container,resolution,payload_bytes,bits_per_channel,operation,threads,backend,time";
+const string STEGANOGRAPHY_BENCHMARK_RESULTS = "steganography_results.csv";
 
-struct ByteData{
-    unsigned char byte;
-    size_t posInMainBuffer;
-    size_t row;
-    size_t col;
+/*
+Archivo de información proyectado en memoria con mmap: los hilos leen los bytes directamente de las páginas
+del archivo, sin copiarlos a un buffer propio ni guardar metadatos por byte.
+*/
+struct MappedPayload{
+    const unsigned char* data;
+    size_t size;
 };
 
-int getFileSize(FILE* file) {
-    fseek(file, 0, SEEK_END);
-    int size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    return size;
+bool mapPayload(const char* fileName, MappedPayload& payload){
+    payload.data = nullptr;
+    payload.size = 0;
+    int descriptor = open(fileName, O_RDONLY);
+    if (descriptor < 0) {
+        perror("Failed to open file");
+        return false;
+    }
+    struct stat fileStatus;
+    if (fstat(descriptor, &fileStatus) != 0) {
+        perror("Failed to stat file");
+        close(descriptor);
+        return false;
+    }
+    payload.size = fileStatus.st_size;
+    if (payload.size > 0) {
+        void* data = mmap(nullptr, payload.size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (data == MAP_FAILED) {
+            perror("Failed to map file");
+            close(descriptor);
+            payload.size = 0;
+            return false;
+        }
+        madvise(data, payload.size, MADV_SEQUENTIAL);
+        payload.data = static_cast<const unsigned char*>(data);
+    }
+    // La proyección sigue siendo válida después de cerrar el descriptor
+    close(descriptor);
+    return true;
+}
+
+void unmapPayload(MappedPayload& payload){
+    if (payload.data) {
+        munmap(const_cast<unsigned char*>(payload.data), payload.size);
+    }
+    payload.data = nullptr;
+    payload.size = 0;
 }
 
-void verifySizeCompatibility(FILE* file, Mat img){
+void verifySizeCompatibility(size_t payloadSize, Mat img, unsigned bitsPerChannel){
     if (img.channels() != 3) {
         cerr << "Error: Image must be a 3-channel (RGB) image.\n";
         throw runtime_error("Image must be a 3-channel (RGB) image.");
     }
 
-    unsigned int totalBitsToStore = img.rows * img.cols * 3;
-    totalBitsToStore = totalBitsToStore - (img.rows * img.cols / 3); // restar 1 bit cada 3 pixeles
-    unsigned int fileSizeInBits = getFileSize(file);
+    size_t totalBytesToStore = getPayloadCapacity(img.total() * img.channels(), bitsPerChannel);
 
-    if(totalBitsToStore < fileSizeInBits){
+    if(totalBytesToStore < payloadSize){
         cerr << "Error: A bigger container or smaller info is needed.\n";
         throw runtime_error("A bigger container or smaller info is needed.");
     }
 }
 
-void embed(Mat &img, int thread){
-    for(size_t i = threadsStartPositionsBuffer[thread]; i < threadsEndPositionsBuffer[thread]; i++){
-        ByteData byte = byteDataBuffer[i];
-        unsigned char bits[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-        for(int j = 0; j < 8; j++){
-            bits[j] = (byte.byte >> j) & 1;
-        }
-        
-        for(int i = 0; i < 3; i++){
-            Vec3b pixel = img.at<Vec3b>(byte.row, byte.col + i);
-
-            if(i == 0){ // si está en el primer pixel
-                pixel[0] = (pixel[0] & 0xFE) | bits[0];
-                pixel[1] = (pixel[1] & 0xFE) | bits[1];
-                pixel[2] = (pixel[2] & 0xFE) | bits[2];
-            } else if(i == 1){ // si está en el segundo pixel
-                pixel[0] = (pixel[0] & 0xFE) | bits[3];
-                pixel[1] = (pixel[1] & 0xFE) | bits[4];
-                pixel[2] = (pixel[2] & 0xFE) | bits[5];
-            } else { // si está en el tercer pixel
-                pixel[0] = (pixel[0] & 0xFE) | bits[6];
-                pixel[1] = (pixel[1] & 0xFE) | bits[7];
-            }
+/*
+Escribe los bytes [start, end) de la información. La posición de cada byte en el contenedor se calcula
+directamente: después de la cabecera, con k bits por canal, cada k bytes ocupan 8 canales seguidos del buffer
+continuo de la imagen.
+*/
+void embed(Mat &img, const PayloadHeader& header, const MappedPayload& payload, size_t start, size_t end){
+    embedPayloadBytes(img.data, header, payload.data, start, end);
+}
+
+// Recupera los bytes [start, end) con el formato de la cabecera
+void extract(const Mat &img, const PayloadHeader& header, unsigned char* payload, size_t start, size_t end){
+    extractPayloadBytes(img.data, header, payload, start, end);
+}
+
+size_t getChecksumBlockQuantity(size_t length){
+    return (length + CHECKSUM_BLOCK_SIZE - 1) / CHECKSUM_BLOCK_SIZE;
+}
+
+// Combina, en orden, las sumas Adler-32 de los bloques de CHECKSUM_BLOCK_SIZE bytes de un tramo de length bytes,
+// empezando por el bloque firstBlock
+uint32_t combineBlockChecksums(const vector<uint32_t>& checksums, size_t firstBlock, size_t length){
+    uint32_t checksum = 1;
+    for (size_t block = 0; block < getChecksumBlockQuantity(length); block++) {
+        size_t blockLength = min(CHECKSUM_BLOCK_SIZE, length - block * CHECKSUM_BLOCK_SIZE);
+        checksum = adler32Combine(checksum, checksums[firstBlock + block], blockLength);
+    }
+    return checksum;
+}
+
+// Bloque de CHECKSUM_BLOCK_SIZE bytes de un fragmento; start y end son relativos al inicio del fragmento
+struct ShardBlock{
+    size_t shard;
+    size_t start;
+    size_t end;
+};
+
+// Bloques de todos los fragmentos, en orden; firstBlocks[s] es el primer bloque del fragmento s
+vector<ShardBlock> getShardBlocks(const vector<PayloadHeader>& headers, vector<size_t>& firstBlocks){
+    vector<ShardBlock> blocks;
+    firstBlocks.resize(headers.size());
+    for (size_t shard = 0; shard < headers.size(); shard++) {
+        firstBlocks[shard] = blocks.size();
+        for (size_t start = 0; start < headers[shard].length; start += CHECKSUM_BLOCK_SIZE) {
+            ShardBlock block = {shard, start, min(start + CHECKSUM_BLOCK_SIZE, static_cast<size_t>(headers[shard].length))};
+            blocks.push_back(block);
         }
+    }
+    return blocks;
+}
 
-        /*
-        En binario, 0xFE es 11111110. Al realizar una operación AND entre este valor y otro byte, 
-        se garantiza que todos los bits del otro byte se conserven, excepto el bit menos significativo (LSB), 
-        que se establecerá en 0, para después hacerle un OR y poner el LSB que se desea.
-        */
+/*
+Reparte una información de payloadLength bytes entre los contenedores, en orden, llenando cada uno hasta su
+capacidad; los contenedores que sobran no se usan. Las cabeceras quedan sin sumas de verificación, que se
+calculan al esconder la información.
+*/
+vector<PayloadHeader> planShards(const vector<Mat>& containers, size_t payloadLength, unsigned bitsPerChannel){
+    vector<PayloadHeader> headers;
+    size_t offset = 0;
+    for (size_t i = 0; i < containers.size() && (offset < payloadLength || headers.empty()); i++) {
+        if (containers[i].channels() != 3) {
+            cerr << "Error: Image must be a 3-channel (RGB) image.\n";
+            throw runtime_error("Image must be a 3-channel (RGB) image.");
+        }
+        size_t capacity = getPayloadCapacity(containers[i].total() * containers[i].channels(), bitsPerChannel);
+        PayloadHeader header = createPayloadHeader(bitsPerChannel, min(capacity, payloadLength - offset), 0);
+        header.shardIndex = headers.size();
+        header.shardOffset = offset;
+        header.payloadLength = payloadLength;
+        headers.push_back(header);
+        offset += header.length;
+    }
+    if (offset < payloadLength || headers.empty() || headers.size() > UINT16_MAX) {
+        cerr << "Error: A bigger container or smaller info is needed.\n";
+        throw runtime_error("A bigger container or smaller info is needed.");
+    }
+    for (size_t shard = 0; shard < headers.size(); shard++) {
+        headers[shard].shardCount = headers.size();
     }
+    return headers;
 }
 
-void parallelRead(const char* fileName, Mat img, int& fileSize, int numThreads){
-    FILE* file = fopen(fileName, "rb");
-    if (!file) {
-        perror("Failed to open file");
-        return;
+/*
+Esconde cada fragmento en su contenedor. Los bloques de todos los fragmentos se reparten juntos entre los hilos,
+así que varios contenedores se procesan a la vez; como las posiciones se calculan, no hay pasada serial previa.
+Mientras el bloque está en caché se calcula también su suma Adler-32, y al final las sumas de los bloques se
+combinan para la cabecera de cada fragmento y para la de la información completa.
+*/
+void embedShards(vector<Mat>& containers, vector<PayloadHeader>& headers, const unsigned char* payload, int numThreads){
+    vector<size_t> firstBlocks;
+    vector<ShardBlock> blocks = getShardBlocks(headers, firstBlocks);
+    vector<uint32_t> checksums(blocks.size());
+    parallelFor(0, blocks.size(), numThreads, [&](int firstBlock, int lastBlock, int worker) {
+        for (int i = firstBlock; i < lastBlock; i++) {
+            const ShardBlock& block = blocks[i];
+            const PayloadHeader& header = headers[block.shard];
+            const unsigned char* shardPayload = payload + header.shardOffset;
+            embedPayloadBytes(containers[block.shard].data, header, shardPayload, block.start, block.end);
+            checksums[i] = adler32(shardPayload + block.start, block.end - block.start);
+            addTraceWork(block.end - block.start);
+        }
+    }, 1);
+
+    uint32_t payloadChecksum = 1;
+    for (size_t shard = 0; shard < headers.size(); shard++) {
+        headers[shard].checksum = combineBlockChecksums(checksums, firstBlocks[shard], headers[shard].length);
+        payloadChecksum = adler32Combine(payloadChecksum, headers[shard].checksum, headers[shard].length);
+    }
+    for (size_t shard = 0; shard < headers.size(); shard++) {
+        headers[shard].payloadChecksum = payloadChecksum;
+        writePayloadHeader(containers[shard].data, headers[shard]);
     }
+}
 
-    fileSize = getFileSize(file);
-    fclose(file);
-
-    mainBuffer = new unsigned char[fileSize];
-    byteDataBuffer = new ByteData[fileSize];
-    threadsStartPositionsBuffer = new int[numThreads];
-    threadsEndPositionsBuffer = new int[numThreads];
-    int bytesForEachThread = fileSize / numThreads;
-    int bytesForLastThread = fileSize % numThreads;
-
-    omp_set_num_threads(numThreads);
-    #pragma omp parallel
-    {
-        int thread = omp_get_thread_num();
-        int start = thread * bytesForEachThread;
-        int end = (thread == numThreads - 1) ? start + bytesForEachThread + bytesForLastThread : start + bytesForEachThread;
-
-        threadsStartPositionsBuffer[thread] = start;
-        threadsEndPositionsBuffer[thread] = end;
-
-        FILE* file = fopen(fileName, "rb");
-        if (file) {
-            fseek(file, start, SEEK_SET);
-            fread(mainBuffer + start, 1, end - start, file);
-            fclose(file);
-        } else {
-            printf("Error en el hilos %d\n", thread);
+/*
+Lee las cabeceras de los contenedores, que pueden venir en cualquier orden, comprueba que sus manifiestos
+describan la misma información y la cubran completa, y recupera todos los fragmentos en paralelo, por bloques,
+calculando la suma Adler-32 de cada bloque en la misma pasada. Devuelve false si falta un fragmento, si un
+contenedor no tiene cabecera válida o si alguna suma no coincide.
+*/
+bool extractShards(const vector<Mat>& containers, vector<unsigned char>& payload, int numThreads){
+    vector<PayloadHeader> headers(containers.size());
+    vector<size_t> containerOfShard(containers.size(), containers.size());
+    for (size_t i = 0; i < containers.size(); i++) {
+        PayloadHeader header;
+        if (!containers[i].isContinuous() || !readPayloadHeader(containers[i].data, containers[i].total() * containers[i].channels(), header)) {
+            cerr << "Error: The container has no embedded info.\n";
+            return false;
+        }
+        if (header.shardCount != containers.size() || containerOfShard[header.shardIndex] != containers.size()) {
+            cerr << "Error: The containers do not hold every shard of the info exactly once.\n";
+            return false;
         }
+        headers[header.shardIndex] = header;
+        containerOfShard[header.shardIndex] = i;
+    }
+    size_t offset = 0;
+    for (size_t shard = 0; shard < headers.size(); shard++) {
+        if (headers[shard].shardOffset != offset || headers[shard].payloadLength != headers[0].payloadLength || headers[shard].payloadChecksum != headers[0].payloadChecksum) {
+            cerr << "Error: The shard manifests do not match.\n";
+            return false;
+        }
+        offset += headers[shard].length;
+    }
+    if (headers.empty() || offset != headers[0].payloadLength) {
+        cerr << "Error: The shard manifests do not match.\n";
+        return false;
     }
 
-    size_t row = 0;
-    size_t col = 0;
-    for(size_t i = 0; i < fileSize; i++){
-        if(col % img.cols == 0 && i != 0){
-            row++;
+    payload.resize(offset);
+    vector<size_t> firstBlocks;
+    vector<ShardBlock> blocks = getShardBlocks(headers, firstBlocks);
+    vector<uint32_t> checksums(blocks.size());
+    parallelFor(0, blocks.size(), numThreads, [&](int firstBlock, int lastBlock, int worker) {
+        for (int i = firstBlock; i < lastBlock; i++) {
+            const ShardBlock& block = blocks[i];
+            const PayloadHeader& header = headers[block.shard];
+            unsigned char* shardPayload = payload.data() + header.shardOffset;
+            extractPayloadBytes(containers[containerOfShard[block.shard]].data, header, shardPayload, block.start, block.end);
+            addTraceWork(block.end - block.start);
+            checksums[i] = adler32(shardPayload + block.start, block.end - block.start);
         }
-        ByteData byte = {mainBuffer[i], i, row, col%img.cols};
-        byteDataBuffer[i] = byte;
-        col += 3;
+    }, 1);
+
+    uint32_t payloadChecksum = 1;
+    bool valid = true;
+    for (size_t shard = 0; shard < headers.size(); shard++) {
+        uint32_t checksum = combineBlockChecksums(checksums, firstBlocks[shard], headers[shard].length);
+        valid = valid && checksum == headers[shard].checksum;
+        payloadChecksum = adler32Combine(payloadChecksum, checksum, headers[shard].length);
     }
+    if (!valid || payloadChecksum != headers[0].payloadChecksum) {
+        cerr << "Error: The embedded info is corrupted.\n";
+        return false;
+    }
+    return true;
+}
 
-    delete[] mainBuffer;
+// Un solo contenedor es el fragmento 0 de 1
+void parallelEmbed(Mat &img, const MappedPayload& payload, int numThreads, unsigned bitsPerChannel){
+    TraceRegion trace("parallelEmbed", numThreads);
+    vector<Mat> containers(1, img);
+    vector<PayloadHeader> headers = planShards(containers, payload.size, bitsPerChannel);
+    embedShards(containers, headers, payload.data, numThreads);
 }
 
-void parallelEmbed(Mat &img, int numThreads){
-    omp_set_num_threads(numThreads);
-    #pragma omp parallel
-    {
-        int thread = omp_get_thread_num();
-        embed(img, thread);
+bool parallelExtract(const Mat &img, vector<unsigned char>& payload, int numThreads){
+    TraceRegion trace("parallelExtract", numThreads);
+    return extractShards(vector<Mat>(1, img), payload, numThreads);
+}
+
+/*
+Decodifica los contenedores en paralelo, uno por hilo; devuelve false si alguno no se pudo leer. Con useCache los
+contenedores originales salen de la caché de imágenes decodificadas; al verificar un resultado se decodifica el PNG.
+*/
+bool readContainers(const vector<string>& paths, vector<Mat>& containers, int numThreads, bool useCache = true){
+    containers.assign(paths.size(), Mat());
+    parallelFor(0, paths.size(), numThreads, [&](int first, int last, int worker) {
+        for (int i = first; i < last; i++) {
+            TraceRegion trace("readContainer");
+            Mat container = useCache ? readCachedImage(paths[i]) : imread(paths[i]);
+            containers[i] = container.isContinuous() ? container : container.clone();
+        }
+    }, 1);
+    for (size_t i = 0; i < containers.size(); i++) {
+        if (containers[i].empty()) {
+            cerr << "Error: Unable to load the image: " << paths[i] << endl;
+            return false;
+        }
     }
+    return true;
+}
 
-    imwrite("results/multi/result.jpg", img);
+// Codifica los contenedores en paralelo, sin pérdida, uno por hilo
+void writeContainers(const vector<Mat>& containers, const vector<string>& paths, int numThreads){
+    parallelFor(0, containers.size(), numThreads, [&](int first, int last, int worker) {
+        for (int i = first; i < last; i++) {
+            TraceRegion trace("writeContainer");
+            imwrite(paths[i], containers[i]);
+        }
+    }, 1);
 }
 
-int steganography(int numThreads){
+/*
+Esconde la información, guarda el contenedor en PNG, lo vuelve a leer y recupera la información, midiendo cada
+etapa; si lo recuperado no coincide byte a byte con el archivo original, el viaje de ida y vuelta falla.
+*/
+int steganography(int numThreads, unsigned bitsPerChannel = DEFAULT_BITS_PER_CHANNEL){
     const char* fileName = "./info/img.jpg";
-    FILE* file = fopen(fileName, "rb");
-    Mat img = imread("./containers/mona_lisa.jpg");
-    int fileSize;
+    Mat img = readCachedImage("./containers/mona_lisa.jpg");
+    if (!img.isContinuous()) {
+        img = img.clone();
+    }
+
+    MappedPayload payload;
+    if (!mapPayload(fileName, payload)) {
+        return 1;
+    }
+    verifySizeCompatibility(payload.size, img, bitsPerChannel);
+
+    double startTime = omp_get_wtime();
+    parallelEmbed(img, payload, numThreads, bitsPerChannel);
+    double embedTime = omp_get_wtime() - startTime;
+
+    startTime = omp_get_wtime();
+    imwrite(STEGANOGRAPHY_RESULT_PATH, img);
+    Mat container = imread(STEGANOGRAPHY_RESULT_PATH);
+    double storeTime = omp_get_wtime() - startTime;
+
+    vector<unsigned char> extracted;
+    startTime = omp_get_wtime();
+    bool valid = parallelExtract(container, extracted, numThreads);
+    double extractTime = omp_get_wtime() - startTime;
+    valid = valid && extracted.size() == payload.size && equal(extracted.begin(), extracted.end(), payload.data);
+
+    double megabytes = payload.size / 1e6;
+    cout << "Steganography round trip of " << payload.size << " bytes with " << numThreads << " threads and " << bitsPerChannel << " bits per channel: "
+         << "embed " << megabytes / embedTime << " MB/s, PNG write and read " << storeTime << " s, "
+         << "extract " << megabytes / extractTime << " MB/s, " << (valid ? "verified" : "FAILED") << endl;
+    unmapPayload(payload);
 
+    return valid ? 0 : 1;
+}
+
+vector<string> getSteganographyBenchmarkRow(const string& containerPath, const Mat& img, size_t payloadSize, unsigned bitsPerChannel, const string& operation, unsigned threads, const string& backend, const TimingStatistics& statistics){
+    return {containerPath, to_string(img.cols) + "x" + to_string(img.rows), to_string(payloadSize), to_string(bitsPerChannel), operation, to_string(threads), backend, formatBenchmarkNumber(statistics.median)};
+}
+
+/*
+Mide cada etapa por separado con el arnés de benchmark/benchmark.hpp: decodificar el contenedor (imread sin caché),
+esconder y recuperar la información con cada cantidad de hilos y cada backend, y codificar el resultado en PNG.
+La escritura del PNG no entra en las mediciones de esconder y recuperar.
+*/
+void benchmarkSteganography(const BenchmarkConfig& config, const string& containerPath, const char* fileName, unsigned bitsPerChannel = DEFAULT_BITS_PER_CHANNEL){
+    Mat img = readCachedImage(containerPath);
+    if (img.empty()) {
+        cerr << "Error: Unable to load the image: " << containerPath << endl;
+        return;
+    }
+    img = img.clone();
+    MappedPayload payload;
+    if (!mapPayload(fileName, payload)) {
+        return;
+    }
+    verifySizeCompatibility(payload.size, img, bitsPerChannel);
+    BenchmarkReport report;
+    if (!openBenchmarkReport(report, STEGANOGRAPHY_BENCHMARK_RESULTS, STEGANOGRAPHY_BENCHMARK_COLUMNS)) {
+        cerr << "Error opening file " << STEGANOGRAPHY_BENCHMARK_RESULTS << endl;
+        unmapPayload(payload);
+        return;
+    }
+
+    TimingStatistics statistics = measure(config, [&containerPath]() { imread(containerPath); });
+    writeBenchmarkResult(report, getSteganographyBenchmarkRow(containerPath, img, payload.size, bitsPerChannel, "decode", 1, "serial", statistics), BenchmarkStage::DECODE, statistics);
+
+    ExecutionBackend previousBackend = getExecutionBackend();
+    vector<unsigned char> extracted;
+    for (unsigned threads : config.threadCounts) {
+        for (ExecutionBackend backend : AllExecutionBackends) {
+            setExecutionBackend(backend);
+            cout << "Steganography of " << payload.size << " bytes using " << threads << " threads on " << parseExecutionBackend(backend) << endl;
+            statistics = measure(config, [&]() { parallelEmbed(img, payload, threads, bitsPerChannel); });
+            writeBenchmarkResult(report, getSteganographyBenchmarkRow(containerPath, img, payload.size, bitsPerChannel, "embed", threads, parseExecutionBackend(backend), statistics), BenchmarkStage::COMPUTE, statistics);
+            statistics = measure(config, [&]() { parallelExtract(img, extracted, threads); });
+            writeBenchmarkResult(report, getSteganographyBenchmarkRow(containerPath, img, payload.size, bitsPerChannel, "extract", threads, parseExecutionBackend(backend), statistics), BenchmarkStage::COMPUTE, statistics);
+        }
+    }
+    setExecutionBackend(previousBackend);
+
+    vector<uchar> encoded;
+    statistics = measure(config, [&]() { imencode(".png", img, encoded); });
+    writeBenchmarkResult(report, getSteganographyBenchmarkRow(containerPath, img, payload.size, bitsPerChannel, "encode", 1, "serial", statistics), BenchmarkStage::ENCODE, statistics);
+
+    closeBenchmarkReport(report);
+    unmapPayload(payload);
+}
+
+/*
+Reparte la información entre los contenedores que hagan falta, en orden, y hace el viaje de ida y vuelta completo:
+decodifica los contenedores en paralelo, esconde los fragmentos, los guarda en PNG en paralelo, los vuelve a leer y
+recupera la información, midiendo cada etapa.
+*/
+int steganographySharded(const vector<string>& containerPaths, const char* fileName, int numThreads, unsigned bitsPerChannel = DEFAULT_BITS_PER_CHANNEL){
+    MappedPayload payload;
+    if (!mapPayload(fileName, payload)) {
+        return 1;
+    }
+
+    vector<Mat> containers;
+    double startTime = omp_get_wtime();
+    if (!readContainers(containerPaths, containers, numThreads)) {
+        unmapPayload(payload);
+        return 1;
+    }
+    double decodeTime = omp_get_wtime() - startTime;
+
+    startTime = omp_get_wtime();
+    vector<PayloadHeader> headers = planShards(containers, payload.size, bitsPerChannel);
+    containers.resize(headers.size());
+    embedShards(containers, headers, payload.data, numThreads);
+    double embedTime = omp_get_wtime() - startTime;
+
+    vector<string> shardPaths;
+    for (size_t shard = 0; shard < headers.size(); shard++) {
+        shardPaths.push_back(STEGANOGRAPHY_SHARD_PATH + to_string(shard) + ".png");
+    }
+    startTime = omp_get_wtime();
+    writeContainers(containers, shardPaths, numThreads);
+    double encodeTime = omp_get_wtime() - startTime;
 
-    verifySizeCompatibility(file, img);
-    parallelRead(fileName, img, fileSize, numThreads);
-    parallelEmbed(img, numThreads);
+    vector<unsigned char> extracted;
+    startTime = omp_get_wtime();
+    bool valid = readContainers(shardPaths, containers, numThreads, false) && extractShards(containers, extracted, numThreads);
+    double extractTime = omp_get_wtime() - startTime;
+    valid = valid && extracted.size() == payload.size && equal(extracted.begin(), extracted.end(), payload.data);
 
-    delete[] byteDataBuffer;
-    delete[] threadsStartPositionsBuffer;
-    delete[] threadsEndPositionsBuffer;
+    double megabytes = payload.size / 1e6;
+    cout << "Sharded steganography of " << payload.size << " bytes in " << headers.size() << " containers with " << numThreads << " threads: "
+         << "decode " << decodeTime << " s, embed " << megabytes / embedTime << " MB/s, PNG encode " << encodeTime << " s, "
+         << "decode and extract " << extractTime << " s, " << (valid ? "verified" : "FAILED") << endl;
+    unmapPayload(payload);
 
-    return 0;
+    return valid ? 0 : 1;
 }
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstring>
+#include <stdint.h>
+#include <stdlib.h>
+#include "../kernels/kernels.hpp"
+
+/*
+Formato de un contenedor: los primeros PAYLOAD_HEADER_CHANNELS canales guardan una cabecera de 44 bytes, siempre
+con ventanas de 8 canales seguidos (stride 8), y después viene la información empaquetada con los k = 1..4 bits
+por canal que diga la cabecera. El campo stride siempre vale 8; los contenedores de la versión 1 (stride 9, un
+byte cada 3 píxeles) ya no se leen.
+Cabecera, en little-endian:
+    magic "STEG" (4) | versión (1) | stride (1) | bits por canal (1) | reservado (1) | longitud (8) | Adler-32 (4) |
+    fragmento (2) | fragmentos (2) | desplazamiento (8) | longitud total (8) | Adler-32 total (4)
+Los últimos campos son el manifiesto: una información demasiado grande para un contenedor se reparte en varios
+fragmentos, uno por contenedor, y cada uno guarda qué tramo de la información lleva (desplazamiento y longitud) y
+cómo comprobarla completa. Un contenedor normal es el fragmento 0 de 1.
+La suma Adler-32 se puede calcular por bloques en paralelo y combinar después con adler32Combine(), así que
+verificar la información no obliga a una pasada serial.
+*/
+
+const unsigned char PAYLOAD_MAGIC[4] = {'S', 'T', 'E', 'G'};
+const unsigned char PAYLOAD_VERSION = 2;
+const size_t PAYLOAD_HEADER_SIZE = 44;
+// 44 * 8 = 352 canales, redondeados a múltiplo de 24 para que la información empiece al inicio de un píxel
+const size_t PAYLOAD_HEADER_CHANNELS = 360;
+// Bytes de información por bloque de la suma de verificación, que también es la unidad de reparto entre hilos.
+// Es múltiplo de 3 para que, con k = 3, cada bloque empiece en un grupo de 8 canales
+const size_t CHECKSUM_BLOCK_SIZE = 3 << 16;
+const unsigned MAX_BITS_PER_CHANNEL = 4;
+const uint32_t ADLER_BASE = 65521;
+// Mayor cantidad de bytes que se pueden sumar antes de reducir módulo ADLER_BASE sin desbordar 32 bits
+const size_t ADLER_NMAX = 5552;
+
+// length y checksum describen el fragmento de este contenedor; el resto es el manifiesto de la información completa
+struct PayloadHeader{
+    unsigned char stride;
+    unsigned char bitsPerChannel;
+    uint64_t length;
+    uint32_t checksum;
+    uint16_t shardIndex;
+    uint16_t shardCount;
+    uint64_t shardOffset;
+    uint64_t payloadLength;
+    uint32_t payloadChecksum;
+};
+
+// Cabecera de un contenedor que lleva la información completa, es decir, el fragmento 0 de 1
+PayloadHeader createPayloadHeader(unsigned bitsPerChannel, uint64_t length, uint32_t checksum){
+    PayloadHeader header = {8, static_cast<unsigned char>(bitsPerChannel), length, checksum, 0, 1, 0, length, checksum};
+    return header;
+}
+
+void writeLittleEndian(unsigned char* bytes, uint64_t value, size_t size){
+    for (size_t i = 0; i < size; i++) {
+        bytes[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+}
+
+uint64_t readLittleEndian(const unsigned char* bytes, size_t size){
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+    }
+    return value;
+}
+
+uint32_t adler32(const unsigned char* data, size_t length, uint32_t adler = 1){
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+    while (length > 0) {
+        size_t block = length < ADLER_NMAX ? length : ADLER_NMAX;
+        length -= block;
+        for (size_t i = 0; i < block; i++) {
+            a += data[i];
+            b += a;
+        }
+        data += block;
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+    return (b << 16) | a;
+}
+
+// Suma Adler-32 de la concatenación de dos bloques, a partir de las sumas de cada uno (como adler32_combine de zlib)
+uint32_t adler32Combine(uint32_t first, uint32_t second, size_t secondLength){
+    uint32_t remainder = secondLength % ADLER_BASE;
+    uint32_t a = first & 0xFFFF;
+    uint32_t b = (static_cast<uint64_t>(remainder) * a) % ADLER_BASE;
+    a += (second & 0xFFFF) + ADLER_BASE - 1;
+    b += (first >> 16) + (second >> 16) + ADLER_BASE - remainder;
+    if (a >= ADLER_BASE) a -= ADLER_BASE;
+    if (a >= ADLER_BASE) a -= ADLER_BASE;
+    if (b >= 2 * ADLER_BASE) b -= 2 * ADLER_BASE;
+    if (b >= ADLER_BASE) b -= ADLER_BASE;
+    return (b << 16) | a;
+}
+
+// Bytes de información que caben en channels canales después de la cabecera, con los bits por canal dados
+size_t getPayloadCapacity(size_t channels, unsigned bitsPerChannel = 1){
+    if (channels < PAYLOAD_HEADER_CHANNELS) {
+        return 0;
+    }
+    return (channels - PAYLOAD_HEADER_CHANNELS) * bitsPerChannel / 8;
+}
+
+// Canal, contado desde el final de la cabecera, donde empieza el byte byteIndex; con k = 3 byteIndex debe ser múltiplo de 3
+size_t getPayloadChannelOffset(unsigned bitsPerChannel, size_t byteIndex){
+    return byteIndex * 8 / bitsPerChannel;
+}
+
+void embedPayloadBytes(unsigned char* channels, const PayloadHeader& header, const unsigned char* payload, size_t start, size_t end){
+    unsigned char* window = channels + PAYLOAD_HEADER_CHANNELS + getPayloadChannelOffset(header.bitsPerChannel, start);
+    embedPackedLsbBytes(window, header.bitsPerChannel, payload + start, end - start);
+}
+
+void extractPayloadBytes(const unsigned char* channels, const PayloadHeader& header, unsigned char* payload, size_t start, size_t end){
+    const unsigned char* window = channels + PAYLOAD_HEADER_CHANNELS + getPayloadChannelOffset(header.bitsPerChannel, start);
+    extractPackedLsbBytes(window, header.bitsPerChannel, payload + start, end - start);
+}
+
+void writePayloadHeader(unsigned char* channels, const PayloadHeader& header){
+    unsigned char bytes[PAYLOAD_HEADER_SIZE] = {0};
+    memcpy(bytes, PAYLOAD_MAGIC, sizeof(PAYLOAD_MAGIC));
+    bytes[4] = PAYLOAD_VERSION;
+    bytes[5] = header.stride;
+    bytes[6] = header.bitsPerChannel;
+    writeLittleEndian(bytes + 8, header.length, 8);
+    writeLittleEndian(bytes + 16, header.checksum, 4);
+    writeLittleEndian(bytes + 20, header.shardIndex, 2);
+    writeLittleEndian(bytes + 22, header.shardCount, 2);
+    writeLittleEndian(bytes + 24, header.shardOffset, 8);
+    writeLittleEndian(bytes + 32, header.payloadLength, 8);
+    writeLittleEndian(bytes + 40, header.payloadChecksum, 4);
+    embedLsbBytes(channels, 8, bytes, PAYLOAD_HEADER_SIZE);
+}
+
+// Lee la cabecera de un contenedor de channelCount canales; falla si no hay cabecera o si describe más información de la que cabe
+bool readPayloadHeader(const unsigned char* channels, size_t channelCount, PayloadHeader& header){
+    if (channelCount < PAYLOAD_HEADER_CHANNELS) {
+        return false;
+    }
+    unsigned char bytes[PAYLOAD_HEADER_SIZE];
+    extractLsbBytes(channels, 8, bytes, PAYLOAD_HEADER_SIZE);
+    if (memcmp(bytes, PAYLOAD_MAGIC, sizeof(PAYLOAD_MAGIC)) != 0 || bytes[4] != PAYLOAD_VERSION || bytes[5] != 8) {
+        return false;
+    }
+    if (bytes[6] < 1 || bytes[6] > MAX_BITS_PER_CHANNEL) {
+        return false;
+    }
+    header.stride = bytes[5];
+    header.bitsPerChannel = bytes[6];
+    header.length = readLittleEndian(bytes + 8, 8);
+    header.checksum = readLittleEndian(bytes + 16, 4);
+    header.shardIndex = readLittleEndian(bytes + 20, 2);
+    header.shardCount = readLittleEndian(bytes + 22, 2);
+    header.shardOffset = readLittleEndian(bytes + 24, 8);
+    header.payloadLength = readLittleEndian(bytes + 32, 8);
+    header.payloadChecksum = readLittleEndian(bytes + 40, 4);
+    if (header.shardIndex >= header.shardCount || header.shardOffset > header.payloadLength || header.length > header.payloadLength - header.shardOffset) {
+        return false;
+    }
+    return header.length <= getPayloadCapacity(channelCount, header.bitsPerChannel);
+}
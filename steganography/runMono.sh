@@ -1 +1 @@
-g++ -fopenmp -I/usr/include/opencv4 -L/usr/lib -lopencv_core -lopencv_imgcodecs -lopencv_highgui mono.cpp -o mono && ./mono
\ No newline at end of file
+(cd ../kernels && sh build_kernels.sh) && g++ -fopenmp -O2 -I/usr/include/opencv4 -L/usr/lib mono.cpp -o mono -L../kernels -limagekernels -lopencv_core -lopencv_imgcodecs -lopencv_highgui && ./mono
\ No newline at end of file
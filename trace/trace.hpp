@@ -0,0 +1,400 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <linux/perf_event.h>
+#include <memory>
+#include <mutex>
+#include <omp.h>
+#include <stdint.h>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// ------------------------------------------------------
+// Tracing
+
+// Tracing is off by default. While it is off, each hook costs one relaxed atomic load. When it is on:
+// - A TraceRegion marks a kernel or an I/O call. Every chunk that parallelFor runs inside a region becomes a span
+//   on its thread, with the worker index and a work count. The work count is the number of indexes in the chunk,
+//   unless the body reports groups or bytes through addTraceWork().
+// - When a region ends, its per-worker busy time and work give the imbalance ratios (maximum over mean, counting
+//   idle workers) kept in the summary. A ratio near 1 with poor scaling points at memory bandwidth rather than at
+//   the split of the work.
+// - With hardware counters on, every span also records cycles and last-level cache misses read through
+//   perf_event_open. The counters are per thread and count user space only. When the kernel refuses them
+//   (perf_event_paranoid, containers) they are left out.
+// Spans go to per-thread buffers without locking, so writeChromeTrace() and writeTraceSummary() must run when
+// no traced work is in flight.
+
+const int TRACE_COUNTER_UNOPENED = -2;
+const string TRACE_SUMMARY_COLUMNS = "region,threads,time,max_busy,mean_busy,time_imbalance,max_work,mean_work,work_imbalance,cycles,llc_misses";
+
+struct TraceSpan
+{
+	const char *name;
+	bool chunk;
+	int worker;
+	double start;
+	double duration;
+	uint64_t work;
+	int64_t cycles;
+	int64_t llcMisses;
+};
+
+struct TraceThread
+{
+	int id;
+	int cyclesCounter;
+	int llcMissesCounter;
+	vector<TraceSpan> spans;
+};
+
+struct TraceRegionSummary
+{
+	string name;
+	int threads;
+	double time;
+	double maxBusy;
+	double meanBusy;
+	double timeImbalance;
+	uint64_t maxWork;
+	double meanWork;
+	double workImbalance;
+	int64_t cycles;
+	int64_t llcMisses;
+};
+
+struct TraceState
+{
+	TraceState() : enabled(false), hardwareCounters(false), origin(0.0) {}
+	atomic<bool> enabled;
+	atomic<bool> hardwareCounters;
+	double origin;
+	mutex stateMutex;
+	vector<unique_ptr<TraceThread> > threads;
+	vector<TraceRegionSummary> regions;
+};
+
+TraceState &getTraceState()
+{
+	static TraceState state;
+	return state;
+}
+
+bool isTracingEnabled()
+{
+	return getTraceState().enabled.load(memory_order_relaxed);
+}
+
+// Starts a new trace, dropping whatever was recorded before
+void setTracingEnabled(bool enabled, bool hardwareCounters = false)
+{
+	TraceState &state = getTraceState();
+	lock_guard<mutex> lock(state.stateMutex);
+	if (enabled)
+	{
+		for (size_t i = 0; i < state.threads.size(); ++i)
+		{
+			state.threads[i]->spans.clear();
+		}
+		state.regions.clear();
+		state.origin = omp_get_wtime();
+		state.hardwareCounters = hardwareCounters;
+	}
+	state.enabled = enabled;
+}
+
+int openPerfCounter(uint32_t type, uint64_t config)
+{
+	perf_event_attr attributes;
+	memset(&attributes, 0, sizeof(attributes));
+	attributes.size = sizeof(attributes);
+	attributes.type = type;
+	attributes.config = config;
+	attributes.exclude_kernel = 1;
+	attributes.exclude_hv = 1;
+	// pid 0 and cpu -1: the calling thread, on whatever CPU it runs
+	return syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+}
+
+int64_t readPerfCounter(int counter)
+{
+	int64_t value = 0;
+	if (counter < 0 || read(counter, &value, sizeof(value)) != static_cast<ssize_t>(sizeof(value)))
+	{
+		return -1;
+	}
+	return value;
+}
+
+// The calling thread's buffer, registered on first use; buffers live as long as the process, like pool workers
+TraceThread &getTraceThread()
+{
+	static thread_local TraceThread *current = nullptr;
+	if (!current)
+	{
+		TraceState &state = getTraceState();
+		lock_guard<mutex> lock(state.stateMutex);
+		state.threads.push_back(unique_ptr<TraceThread>(new TraceThread()));
+		current = state.threads.back().get();
+		current->id = state.threads.size() - 1;
+		current->cyclesCounter = TRACE_COUNTER_UNOPENED;
+		current->llcMissesCounter = TRACE_COUNTER_UNOPENED;
+	}
+	return *current;
+}
+
+// Opens the thread's counters the first time a span asks for them
+void openTraceCounters(TraceThread &thread)
+{
+	if (thread.cyclesCounter == TRACE_COUNTER_UNOPENED)
+	{
+		thread.cyclesCounter = openPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+		thread.llcMissesCounter = openPerfCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	}
+}
+
+class TraceRegion;
+
+TraceRegion *&currentTraceRegion()
+{
+	static thread_local TraceRegion *region = nullptr;
+	return region;
+}
+
+// Times one span on the calling thread and appends it to the thread's buffer
+class TraceSpanTimer
+{
+public:
+	TraceSpanTimer(const char *name, bool chunk, int worker, uint64_t work) : thread(getTraceThread())
+	{
+		span.name = name;
+		span.chunk = chunk;
+		span.worker = worker;
+		span.work = work;
+		counters = getTraceState().hardwareCounters.load(memory_order_relaxed);
+		if (counters)
+		{
+			openTraceCounters(thread);
+		}
+		span.cycles = counters ? readPerfCounter(thread.cyclesCounter) : -1;
+		span.llcMisses = counters ? readPerfCounter(thread.llcMissesCounter) : -1;
+		span.start = omp_get_wtime();
+	}
+
+	// Closes the span and returns it; the destructor does nothing after this
+	const TraceSpan &finish()
+	{
+		if (!finished)
+		{
+			finished = true;
+			span.duration = omp_get_wtime() - span.start;
+			span.start -= getTraceState().origin;
+			span.cycles = span.cycles >= 0 ? readPerfCounter(thread.cyclesCounter) - span.cycles : -1;
+			span.llcMisses = span.llcMisses >= 0 ? readPerfCounter(thread.llcMissesCounter) - span.llcMisses : -1;
+			thread.spans.push_back(span);
+		}
+		return span;
+	}
+
+	~TraceSpanTimer()
+	{
+		finish();
+	}
+
+	TraceSpan span;
+
+private:
+	TraceThread &thread;
+	bool counters;
+	bool finished = false;
+};
+
+// Marks a kernel or an I/O call. Does nothing unless tracing was on when it started.
+class TraceRegion
+{
+public:
+	TraceRegion(const char *name, int threads = 1) : name(name), threads(max(threads, 1)), previous(currentTraceRegion())
+	{
+		if (!isTracingEnabled())
+		{
+			return;
+		}
+		busy.assign(this->threads, 0.0);
+		work.assign(this->threads, 0);
+		timer.reset(new TraceSpanTimer(name, false, 0, 0));
+		currentTraceRegion() = this;
+	}
+
+	~TraceRegion()
+	{
+		if (!timer)
+		{
+			return;
+		}
+		currentTraceRegion() = previous;
+		const TraceSpan &span = timer->finish();
+		TraceRegionSummary summary = {name, threads, span.duration, 0.0, 0.0, 1.0, 0, 0.0, 1.0, span.cycles, span.llcMisses};
+		{
+			lock_guard<mutex> lock(chunkMutex);
+			if (chunks > 0)
+			{
+				summary.maxBusy = *max_element(busy.begin(), busy.end());
+				for (size_t w = 0; w < busy.size(); ++w)
+				{
+					summary.meanBusy += busy[w];
+					summary.meanWork += work[w];
+				}
+				summary.meanBusy /= busy.size();
+				summary.meanWork /= work.size();
+				summary.maxWork = *max_element(work.begin(), work.end());
+				summary.timeImbalance = summary.meanBusy > 0.0 ? summary.maxBusy / summary.meanBusy : 1.0;
+				summary.workImbalance = summary.meanWork > 0.0 ? summary.maxWork / summary.meanWork : 1.0;
+				summary.cycles = chunkCycles;
+				summary.llcMisses = chunkLlcMisses;
+			}
+		}
+		TraceState &state = getTraceState();
+		lock_guard<mutex> lock(state.stateMutex);
+		state.regions.push_back(summary);
+	}
+
+	// Called by the chunk spans of parallelFor, from any worker
+	void addChunk(const TraceSpan &span)
+	{
+		lock_guard<mutex> lock(chunkMutex);
+		size_t worker = span.worker;
+		if (worker >= busy.size())
+		{
+			busy.resize(worker + 1, 0.0);
+			work.resize(worker + 1, 0);
+		}
+		busy[worker] += span.duration;
+		work[worker] += span.work;
+		chunkCycles = span.cycles >= 0 && chunkCycles >= 0 ? chunkCycles + span.cycles : -1;
+		chunkLlcMisses = span.llcMisses >= 0 && chunkLlcMisses >= 0 ? chunkLlcMisses + span.llcMisses : -1;
+		++chunks;
+	}
+
+	const char *getName() const
+	{
+		return name;
+	}
+
+private:
+	const char *name;
+	int threads;
+	TraceRegion *previous;
+	unique_ptr<TraceSpanTimer> timer;
+	mutex chunkMutex;
+	vector<double> busy;
+	vector<uint64_t> work;
+	size_t chunks = 0;
+	int64_t chunkCycles = 0;
+	int64_t chunkLlcMisses = 0;
+};
+
+uint64_t *&currentTraceWork()
+{
+	static thread_local uint64_t *work = nullptr;
+	return work;
+}
+
+// Replaces the index count of the running chunk with a work count the kernel knows better (groups, bytes)
+void addTraceWork(uint64_t count)
+{
+	uint64_t *work = currentTraceWork();
+	if (work)
+	{
+		*work += count;
+	}
+}
+
+// One chunk of a parallelFor, on whatever worker runs it
+class TraceChunk
+{
+public:
+	TraceChunk(TraceRegion *region, int worker, int indexes) : region(region), timer(region ? region->getName() : "parallel_for", true, worker, 0), indexes(indexes), previousWork(currentTraceWork())
+	{
+		currentTraceWork() = &reportedWork;
+	}
+
+	~TraceChunk()
+	{
+		currentTraceWork() = previousWork;
+		timer.span.work = reportedWork > 0 ? reportedWork : indexes;
+		const TraceSpan &span = timer.finish();
+		if (region)
+		{
+			region->addChunk(span);
+		}
+	}
+
+private:
+	TraceRegion *region;
+	TraceSpanTimer timer;
+	uint64_t indexes;
+	uint64_t reportedWork = 0;
+	uint64_t *previousWork;
+};
+
+// Chrome trace-event format, readable by chrome://tracing and Perfetto; tid is the registration order of threads
+bool writeChromeTrace(const string &path)
+{
+	fstream file(path, ios::out | ios::trunc);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	TraceState &state = getTraceState();
+	lock_guard<mutex> lock(state.stateMutex);
+	file << "{\"traceEvents\": [";
+	bool first = true;
+	for (size_t t = 0; t < state.threads.size(); ++t)
+	{
+		const TraceThread &thread = *state.threads[t];
+		for (const TraceSpan &span : thread.spans)
+		{
+			file << (first ? "\n" : ",\n") << "{\"name\": \"" << span.name << "\", \"cat\": \"" << (span.chunk ? "chunk" : "region") << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << thread.id
+				 << ", \"ts\": " << fixed << span.start * 1e6 << ", \"dur\": " << span.duration * 1e6 << defaultfloat
+				 << ", \"args\": {\"worker\": " << span.worker << ", \"work\": " << span.work;
+			if (span.cycles >= 0)
+			{
+				file << ", \"cycles\": " << span.cycles;
+			}
+			if (span.llcMisses >= 0)
+			{
+				file << ", \"llc_misses\": " << span.llcMisses;
+			}
+			file << "}}";
+			first = false;
+		}
+	}
+	file << "\n], \"displayTimeUnit\": \"ms\"}" << endl;
+	return true;
+}
+
+// One row per region that ended while tracing was on; counters are -1 when unavailable
+bool writeTraceSummary(const string &path)
+{
+	fstream file(path, ios::out | ios::trunc);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	TraceState &state = getTraceState();
+	lock_guard<mutex> lock(state.stateMutex);
+	file << TRACE_SUMMARY_COLUMNS << endl;
+	for (const TraceRegionSummary &region : state.regions)
+	{
+		file << region.name << "," << region.threads << "," << region.time << "," << region.maxBusy << "," << region.meanBusy << "," << region.timeImbalance << ","
+			 << region.maxWork << "," << region.meanWork << "," << region.workImbalance << "," << region.cycles << "," << region.llcMisses << endl;
+	}
+	return true;
+}
@@ -0,0 +1 @@
+(cd ../kernels && sh build_kernels.sh) && g++ -o validate validate.cpp -L../kernels -limagekernels -I/usr/include/opencv4 -lopencv_core -lopencv_imgcodecs -lopencv_highgui -lopencv_imgproc -lopencv_features2d -lopencv_calib3d -lopencv_videoio -std=c++11 -O2 -fopenmp && ./validate "$@"
\ No newline at end of file
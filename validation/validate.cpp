@@ -0,0 +1,798 @@
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <omp.h>
+#include <opencv2/opencv.hpp>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../filters/filter.cpp"
+#include "../compression/compression.cpp"
+#include "../steganography/multi.cpp"
+
+//sh run_validation.sh [options] [images] (builds ../kernels/libimagekernels.a first)
+
+using namespace std;
+using namespace cv;
+
+// ------------------------------------------------------
+// Constants
+
+// Images checked when none are given on the command line, one per module
+const vector<string> DEFAULT_VALIDATION_IMAGES = {"../images/filters/img_01.jpg", COMPRESSION_IMAGES_PATH + "img_05.tiff", "../steganography/containers/mona_lisa.jpg"};
+// Synthetic images, columns x rows. None of the sizes is a multiple of a block, tile, strip or vector width,
+// the smallest are smaller than a single block or a container header, and the largest holds several checksum blocks.
+const vector<Size> VALIDATION_IMAGE_SIZES = {Size(1, 1), Size(2, 3), Size(7, 5), Size(33, 17), Size(17, 33), Size(127, 129), Size(257, 131), Size(1031, 769)};
+// An all-white image drives every 16-bit column sum of the compressor to its maximum
+const Size SATURATED_IMAGE_SIZE = Size(65, 49);
+const uint64_t VALIDATION_SEED = 20240917;
+// Every thread count up to this one is checked, so uneven splits are covered; above it, powers of two
+const unsigned int VALIDATION_DENSE_THREADS = 8;
+// Row lengths around every vector width (16, 32 and 64 bytes) and a long odd one
+const vector<size_t> KERNEL_VALIDATION_LENGTHS = {0, 1, 3, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 129, 255, 1000, 4099};
+// Every row is also checked starting 1 to KERNEL_VALIDATION_OFFSETS - 1 bytes after the start of its buffer,
+// so the unaligned loads and stores of the wide variants are exercised
+const size_t KERNEL_VALIDATION_OFFSETS = 4;
+// applyContrast() resizes with its own fixed-point bilinear interpolation, which may round one step away from
+// resize() with INTER_LINEAR; through a table of slope RESIZE_CHECK_CONTRAST that is at most RESIZE_CHECK_TOLERANCE
+const double RESIZE_CHECK_CONTRAST = 1.5;
+const unsigned int RESIZE_CHECK_TOLERANCE = 2;
+
+const string PERFORMANCE_BASELINE_PATH = "performance_baseline.csv";
+const string PERFORMANCE_BASELINE_COLUMNS = "benchmark,variant,backend,threads,throughput";
+// A measurement fails the gate when its throughput falls more than this fraction below the baseline
+const double DEFAULT_REGRESSION_THRESHOLD = 0.10;
+// The performance image is synthetic, so the baseline does not depend on the images given on the command line
+const Size PERFORMANCE_IMAGE_SIZE = Size(1920, 1080);
+const size_t PERFORMANCE_ROW_LENGTH = 1 << 20;
+
+// ------------------------------------------------------
+// Validation
+
+/*
+Every parallel or vectorized kernel is run against a serial, scalar reference and must return the same bytes.
+A reference runs once per input with the scalar kernel variant on one thread. The kernel under test then runs
+with every kernel variant the CPU supports, on both execution backends and at every thread count of
+getValidationThreadCounts(). Where the tree has an independent serial implementation, that is the reference:
+compressImage() for every compressor, the embed of mono.cpp for the steganography and a plain table lookup for
+the contrast. Otherwise the reference is the same function on one thread.
+*/
+
+struct ValidationSummary
+{
+	size_t checks;
+	size_t failures;
+};
+
+struct ValidationOptions
+{
+	unsigned int maxThreads;
+	string baselinePath;
+	double threshold;
+	bool updateBaseline;
+	bool checkPerformance;
+	vector<string> imagePaths;
+};
+
+vector<unsigned int> getValidationThreadCounts(unsigned int maxThreads)
+{
+	vector<unsigned int> threadCounts;
+	for (unsigned int threads = 1; threads <= min(maxThreads, VALIDATION_DENSE_THREADS); ++threads)
+	{
+		threadCounts.push_back(threads);
+	}
+	for (unsigned int threads = VALIDATION_DENSE_THREADS * 2; threads < maxThreads; threads *= 2)
+	{
+		threadCounts.push_back(threads);
+	}
+	if (maxThreads > VALIDATION_DENSE_THREADS)
+	{
+		threadCounts.push_back(maxThreads);
+	}
+	return threadCounts;
+}
+
+vector<KernelVariant> getSupportedKernelVariants()
+{
+	vector<KernelVariant> variants;
+	for (KernelVariant variant : AllKernelVariants)
+	{
+		if (isKernelVariantSupported(variant))
+		{
+			variants.push_back(variant);
+		}
+	}
+	return variants;
+}
+
+// An empty failure is a passed check
+bool recordValidationCheck(ValidationSummary &summary, const string &description, const string &failure)
+{
+	++summary.checks;
+	if (failure.empty())
+	{
+		return true;
+	}
+	++summary.failures;
+	cout << "FAILED " << description << ": " << failure << endl;
+	return false;
+}
+
+// Bytes further than tolerance from the expected ones are a difference
+string findFirstDifference(const unsigned char *expected, const unsigned char *actual, size_t size, unsigned int tolerance = 0)
+{
+	for (size_t i = 0; i < size; ++i)
+	{
+		if (static_cast<unsigned int>(abs(expected[i] - actual[i])) > tolerance)
+		{
+			return "byte " + to_string(i) + " is " + to_string(actual[i]) + " instead of " + to_string(expected[i]) + (tolerance > 0 ? " +- " + to_string(tolerance) : "");
+		}
+	}
+	return "";
+}
+
+bool checkSameBytes(ValidationSummary &summary, const string &description, const vector<unsigned char> &expected, const vector<unsigned char> &actual)
+{
+	if (expected.size() != actual.size())
+	{
+		return recordValidationCheck(summary, description, to_string(actual.size()) + " bytes instead of " + to_string(expected.size()));
+	}
+	return recordValidationCheck(summary, description, findFirstDifference(expected.data(), actual.data(), expected.size()));
+}
+
+bool checkSameImage(ValidationSummary &summary, const string &description, const Mat &expected, const Mat &actual, unsigned int tolerance = 0)
+{
+	if (expected.size() != actual.size() || expected.type() != actual.type())
+	{
+		return recordValidationCheck(summary, description, "the output is " + to_string(actual.cols) + "x" + to_string(actual.rows) + " of type " + to_string(actual.type()) + " instead of " + to_string(expected.cols) + "x" + to_string(expected.rows) + " of type " + to_string(expected.type()));
+	}
+	size_t rowLength = static_cast<size_t>(expected.cols) * expected.elemSize();
+	for (int y = 0; y < expected.rows; ++y)
+	{
+		string difference = findFirstDifference(expected.ptr<uchar>(y), actual.ptr<uchar>(y), rowLength, tolerance);
+		if (!difference.empty())
+		{
+			return recordValidationCheck(summary, description, "in row " + to_string(y) + ", " + difference);
+		}
+	}
+	return recordValidationCheck(summary, description, "");
+}
+
+string describeValidationCase(const string &check, const string &input, KernelVariant variant, const string &backend, unsigned int threads)
+{
+	return check + " on " + input + " with " + parseKernelVariant(variant) + " kernels, " + backend + ", " + to_string(threads) + " threads";
+}
+
+vector<unsigned char> createRandomBytes(size_t size, uint64_t seed)
+{
+	vector<unsigned char> bytes(size);
+	RNG random(seed);
+	for (size_t i = 0; i < size; ++i)
+	{
+		bytes[i] = static_cast<unsigned char>(random.uniform(0, 256));
+	}
+	return bytes;
+}
+
+template <typename T>
+vector<unsigned char> toBytes(const vector<T> &values)
+{
+	const unsigned char *bytes = reinterpret_cast<const unsigned char *>(values.data());
+	return vector<unsigned char>(bytes, bytes + values.size() * sizeof(T));
+}
+
+// ------------------------------------------------------
+// Row kernels
+
+// Random inputs shared by every row kernel check, long enough for the longest row at the largest offset
+struct KernelValidationData
+{
+	vector<unsigned char> bytes;
+	vector<unsigned char> channels;
+	vector<unsigned char> table;
+	vector<unsigned short> sums;
+	vector<float> values;
+	vector<float> outputs;
+};
+
+KernelValidationData createKernelValidationData(size_t maxLength)
+{
+	size_t length = maxLength + KERNEL_VALIDATION_OFFSETS;
+	KernelValidationData data;
+	data.bytes = createRandomBytes(length, VALIDATION_SEED);
+	// 8 channels per byte with 1 bit per channel, plus 8 more to cover the last window
+	data.channels = createRandomBytes(length * 8 + 8, VALIDATION_SEED + 1);
+	data.table = createRandomBytes(256, VALIDATION_SEED + 2);
+	RNG random(VALIDATION_SEED + 3);
+	data.sums.resize(length);
+	data.values.resize(length);
+	data.outputs.resize(length);
+	for (size_t i = 0; i < length; ++i)
+	{
+		data.sums[i] = static_cast<unsigned short>(random.uniform(0, 65536));
+		data.values[i] = random.uniform(-255.0f, 255.0f);
+		data.outputs[i] = random.uniform(-1000.0f, 1000.0f);
+	}
+	return data;
+}
+
+// A kernel of kernels.hpp run on length elements that start offset elements into the inputs; returns every byte it wrote
+struct KernelCheck
+{
+	string name;
+	function<vector<unsigned char>(size_t, size_t)> run;
+};
+
+vector<KernelCheck> getKernelChecks(const KernelValidationData &data)
+{
+	const KernelValidationData *inputs = &data;
+	vector<KernelCheck> checks;
+	checks.push_back({"accumulateRow", [inputs](size_t length, size_t offset) {
+		vector<unsigned short> sums(inputs->sums.begin() + offset, inputs->sums.begin() + offset + length);
+		accumulateRow(inputs->bytes.data() + offset, sums.data(), length);
+		return toBytes(sums);
+	}});
+	checks.push_back({"applyLookupTableRow", [inputs](size_t length, size_t offset) {
+		vector<unsigned char> output(length + offset);
+		applyLookupTableRow(inputs->bytes.data() + offset, output.data() + offset, length, inputs->table.data());
+		return output;
+	}});
+	checks.push_back({"applyLookupTableRow in place", [inputs](size_t length, size_t offset) {
+		vector<unsigned char> row(inputs->bytes.begin(), inputs->bytes.begin() + offset + length);
+		applyLookupTableRow(row.data() + offset, row.data() + offset, length, inputs->table.data());
+		return row;
+	}});
+	checks.push_back({"accumulateWeightedRow", [inputs](size_t length, size_t offset) {
+		vector<float> output(inputs->outputs.begin() + offset, inputs->outputs.begin() + offset + length);
+		accumulateWeightedRow(output.data(), inputs->values.data() + offset, 0.3712f, length);
+		return toBytes(output);
+	}});
+	checks.push_back({"embedLsbBytes", [inputs](size_t length, size_t offset) {
+		vector<unsigned char> channels(inputs->channels.begin(), inputs->channels.begin() + offset + length * 8 + 8);
+		embedLsbBytes(channels.data() + offset, 8, inputs->bytes.data() + offset, length);
+		return channels;
+	}});
+	checks.push_back({"extractLsbBytes", [inputs](size_t length, size_t offset) {
+		vector<unsigned char> payload(length);
+		extractLsbBytes(inputs->channels.data() + offset, 8, payload.data(), length);
+		return payload;
+	}});
+	for (unsigned bitsPerChannel = 1; bitsPerChannel <= MAX_BITS_PER_CHANNEL; ++bitsPerChannel)
+	{
+		checks.push_back({"embedPackedLsbBytes " + to_string(bitsPerChannel) + " bits", [inputs, bitsPerChannel](size_t length, size_t offset) {
+			vector<unsigned char> channels(inputs->channels.begin(), inputs->channels.begin() + offset + length * 8 / bitsPerChannel + 8);
+			embedPackedLsbBytes(channels.data() + offset, bitsPerChannel, inputs->bytes.data() + offset, length);
+			return channels;
+		}});
+		checks.push_back({"extractPackedLsbBytes " + to_string(bitsPerChannel) + " bits", [inputs, bitsPerChannel](size_t length, size_t offset) {
+			vector<unsigned char> payload(length);
+			extractPackedLsbBytes(inputs->channels.data() + offset, bitsPerChannel, payload.data(), length);
+			return payload;
+		}});
+	}
+	return checks;
+}
+
+// Compares every vectorized variant of every row kernel with the scalar variant
+void validateKernels(ValidationSummary &summary)
+{
+	KernelValidationData data = createKernelValidationData(*max_element(KERNEL_VALIDATION_LENGTHS.begin(), KERNEL_VALIDATION_LENGTHS.end()));
+	vector<KernelVariant> variants = getSupportedKernelVariants();
+	for (const KernelCheck &check : getKernelChecks(data))
+	{
+		for (size_t length : KERNEL_VALIDATION_LENGTHS)
+		{
+			for (size_t offset = 0; offset < KERNEL_VALIDATION_OFFSETS; ++offset)
+			{
+				setKernelVariant(KernelVariant::SCALAR);
+				vector<unsigned char> expected = check.run(length, offset);
+				for (KernelVariant variant : variants)
+				{
+					setKernelVariant(variant);
+					string input = to_string(length) + " elements at offset " + to_string(offset);
+					checkSameBytes(summary, describeValidationCase(check.name, input, variant, "serial", 1), expected, check.run(length, offset));
+				}
+			}
+		}
+	}
+}
+
+// ------------------------------------------------------
+// Image kernels
+
+// An operation on a whole image. reference runs once per image with the scalar kernels on one thread, and run
+// must return the same bytes for every kernel variant, backend and thread count, or bytes at most tolerance away
+// when the reference is an independent implementation that rounds differently. Images with fewer than
+// minimumChannels channels are skipped.
+struct ImageCheck
+{
+	string name;
+	size_t minimumChannels;
+	function<Mat(const Mat &)> reference;
+	function<Mat(const Mat &, int)> run;
+	unsigned int tolerance;
+};
+
+// applyContrast() and applyFilterChain() take their thread count from OpenMP
+Mat runWithOpenMPThreads(int threads, const function<Mat()> &operation)
+{
+	int previousThreads = omp_get_max_threads();
+	omp_set_num_threads(threads);
+	Mat result = operation();
+	omp_set_num_threads(previousThreads);
+	return result;
+}
+
+// Without resizing, applyContrast() maps every channel byte through its table; here that is a plain loop
+Mat applyLookupTableSerially(const Mat &image, const LookupTable &table)
+{
+	Mat result = image.clone();
+	for (int y = 0; y < result.rows; ++y)
+	{
+		uchar *row = result.ptr<uchar>(y);
+		for (size_t i = 0; i < static_cast<size_t>(result.cols) * result.channels(); ++i)
+		{
+			row[i] = table[row[i]];
+		}
+	}
+	return result;
+}
+
+// Shrinks the width and enlarges the height, so both directions of the interpolation are covered
+Size getResizedContrastSize(const Mat &image)
+{
+	return Size(image.cols * 2 / 3 + 1, image.rows * 3 / 2 + 1);
+}
+
+Mat compressSerially(const Mat &image, ImageCompressionRate rate)
+{
+	size_t pixelGroupQuantity;
+	return compressImage(image.clone(), rate, pixelGroupQuantity);
+}
+
+// Payload for a container: one byte short of its capacity, so the last group of channels is only partly used
+vector<unsigned char> createValidationPayload(const Mat &image, unsigned bitsPerChannel)
+{
+	size_t capacity = getPayloadCapacity(image.total() * image.channels(), bitsPerChannel);
+	return createRandomBytes(capacity > 0 ? capacity - 1 : 0, VALIDATION_SEED + bitsPerChannel);
+}
+
+// The serial embed of mono.cpp: the whole payload in one pass, then the header
+Mat embedSerially(const Mat &image, const vector<unsigned char> &payload, unsigned bitsPerChannel)
+{
+	Mat container = image.clone();
+	PayloadHeader header = createPayloadHeader(bitsPerChannel, payload.size(), adler32(payload.data(), payload.size()));
+	embedPayloadBytes(container.data, header, payload.data(), 0, payload.size());
+	writePayloadHeader(container.data, header);
+	return container;
+}
+
+Mat bytesToMat(const vector<unsigned char> &bytes)
+{
+	return bytes.empty() ? Mat() : Mat(1, bytes.size(), CV_8UC1, const_cast<unsigned char *>(bytes.data())).clone();
+}
+
+vector<ImageCheck> getImageChecks()
+{
+	vector<ImageCheck> checks;
+	for (ImageCompressionRate rate : AllImageCompressionRates)
+	{
+		string rateName = parseImageCompressionRate(rate);
+		auto reference = [rate](const Mat &image) { return compressSerially(image, rate); };
+		// Tiles of a single block and tiles that end inside a block, besides the default
+		for (unsigned int tileSize : {1u, 37u, DEFAULT_TILE_SIZE})
+		{
+			checks.push_back({"compressImageThreads " + rateName + " tile " + to_string(tileSize), 0, reference, [rate, tileSize](const Mat &image, int threads) {
+				size_t pixelGroupQuantity, pixelGroupQuantityPerThread;
+				return compressImageThreads(image.clone(), rate, pixelGroupQuantity, pixelGroupQuantityPerThread, threads, tileSize);
+			}});
+			checks.push_back({"compressImageGridThreads " + rateName + " tile " + to_string(tileSize), 0, reference, [rate, tileSize](const Mat &image, int threads) {
+				size_t pixelGroupQuantity, pixelGroupQuantityPerThread;
+				return expandCompressedImage(compressImageGridThreads(image, rate, pixelGroupQuantity, pixelGroupQuantityPerThread, threads, tileSize), threads);
+			}});
+		}
+		size_t level = find(AllImageCompressionRates.begin(), AllImageCompressionRates.end(), rate) - AllImageCompressionRates.begin();
+		checks.push_back({"compressImagePyramid " + rateName, 0, reference, [level](const Mat &image, int threads) {
+			vector<size_t> pixelGroupQuantities;
+			return expandCompressedImage(compressImagePyramid(image, pixelGroupQuantities, threads)[level], threads);
+		}});
+		checks.push_back({"compressImageIntegral " + rateName, 0, reference, [rate](const Mat &image, int threads) {
+			size_t pixelGroupQuantity;
+			return compressImageIntegral(image.clone(), buildIntegralImage(image, threads), rate, pixelGroupQuantity, threads);
+		}});
+	}
+	for (ImageCompressionVariance variance : {ImageCompressionVariance::LOW, ImageCompressionVariance::HIGH})
+	{
+		auto quadtree = [variance](const Mat &image, int threads) {
+			size_t pixelGroupQuantity;
+			return compressImageQuadtree(image.clone(), buildIntegralImage(image, threads, true), variance, pixelGroupQuantity, threads);
+		};
+		checks.push_back({"compressImageQuadtree " + parseImageCompressionVariance(variance), 0, [quadtree](const Mat &image) { return quadtree(image, 1); }, quadtree});
+	}
+
+	checks.push_back({"applyContrast", 0, [](const Mat &image) { return applyLookupTableSerially(image, buildLookupTable(vector<PointOperation>(1, contrastOperation(-1)))); }, [](const Mat &image, int threads) {
+		return runWithOpenMPThreads(threads, [&image]() { return applyContrast(image, -1, image.cols, image.rows); });
+	}});
+	auto resizedContrast = [](const Mat &image, int threads) {
+		Size size = getResizedContrastSize(image);
+		return runWithOpenMPThreads(threads, [&image, size]() { return applyContrast(image, 40, size.width, size.height); });
+	};
+	checks.push_back({"applyContrast resized", 0, [resizedContrast](const Mat &image) { return resizedContrast(image, 1); }, resizedContrast});
+	// The fused resize against resize() with INTER_LINEAR followed by the table, within RESIZE_CHECK_TOLERANCE
+	checks.push_back({"applyContrast resized against resize()", 0, [](const Mat &image) {
+		Mat resized;
+		resize(image, resized, getResizedContrastSize(image), 0, 0, INTER_LINEAR);
+		return applyLookupTableSerially(resized, buildLookupTable(vector<PointOperation>(1, contrastOperation(RESIZE_CHECK_CONTRAST))));
+	}, [](const Mat &image, int threads) {
+		Size size = getResizedContrastSize(image);
+		return runWithOpenMPThreads(threads, [&image, size]() { return applyContrast(image, RESIZE_CHECK_CONTRAST, size.width, size.height); });
+	}, RESIZE_CHECK_TOLERANCE});
+	auto filterChain = [](const Mat &image, int threads) {
+		vector<FilterStage> chain = {resizeStage(image.cols * 3 / 4 + 1, image.rows * 3 / 4 + 1), pointStage(gammaOperation(1.4)), blurStage(), grayscaleStage(), sharpenStage()};
+		return runWithOpenMPThreads(threads, [&image, &chain]() { return applyFilterChain(image, chain); });
+	};
+	checks.push_back({"applyFilterChain", 0, [filterChain](const Mat &image) { return filterChain(image, 1); }, filterChain});
+	for (AutoContrastMode mode : {AutoContrastMode::STRETCH, AutoContrastMode::EQUALIZE})
+	{
+		auto autoContrast = [mode](const Mat &image, int threads) { return applyAutoContrast(image, mode, threads); };
+		checks.push_back({string("applyAutoContrast ") + (mode == AutoContrastMode::STRETCH ? "stretch" : "equalize"), 0, [autoContrast](const Mat &image) { return autoContrast(image, 1); }, autoContrast});
+	}
+	vector<pair<string, function<Mat(const Mat &, int)> > > convolutions = {
+		{"gaussianBlur", [](const Mat &image, int threads) { return gaussianBlur(image, 2.0, threads); }},
+		{"boxBlur", [](const Mat &image, int threads) { return boxBlur(image, 2, threads); }},
+		{"unsharpMask", [](const Mat &image, int threads) { return unsharpMask(image, 1.5, 1.0, threads); }},
+		{"sobelEdges", [](const Mat &image, int threads) { return sobelEdges(image, threads); }},
+		{"laplacianEdges", [](const Mat &image, int threads) { return laplacianEdges(image, threads); }}};
+	for (const auto &convolution : convolutions)
+	{
+		function<Mat(const Mat &, int)> run = convolution.second;
+		checks.push_back({convolution.first, 0, [run](const Mat &image) { return run(image, 1); }, run});
+	}
+
+	for (unsigned bitsPerChannel = 1; bitsPerChannel <= MAX_BITS_PER_CHANNEL; ++bitsPerChannel)
+	{
+		string bits = " " + to_string(bitsPerChannel) + " bits";
+		checks.push_back({"parallelEmbed" + bits, PAYLOAD_HEADER_CHANNELS, [bitsPerChannel](const Mat &image) { return embedSerially(image, createValidationPayload(image, bitsPerChannel), bitsPerChannel); }, [bitsPerChannel](const Mat &image, int threads) {
+			vector<unsigned char> payload = createValidationPayload(image, bitsPerChannel);
+			MappedPayload mappedPayload = {payload.data(), payload.size()};
+			Mat container = image.clone();
+			parallelEmbed(container, mappedPayload, threads, bitsPerChannel);
+			return container;
+		}});
+		checks.push_back({"parallelExtract" + bits, PAYLOAD_HEADER_CHANNELS, [bitsPerChannel](const Mat &image) { return bytesToMat(createValidationPayload(image, bitsPerChannel)); }, [bitsPerChannel](const Mat &image, int threads) {
+			vector<unsigned char> extracted;
+			if (!parallelExtract(embedSerially(image, createValidationPayload(image, bitsPerChannel), bitsPerChannel), extracted, threads))
+			{
+				// A rejected container never matches the payload, which is a single row of one channel
+				return Mat(1, 1, CV_8UC3);
+			}
+			return bytesToMat(extracted);
+		}});
+	}
+	return checks;
+}
+
+void validateImage(ValidationSummary &summary, const string &imageName, const Mat &image, const vector<ImageCheck> &checks, const vector<unsigned int> &threadCounts)
+{
+	cout << "Validating " << imageName << " (" << image.cols << "x" << image.rows << ")" << endl;
+	vector<KernelVariant> variants = getSupportedKernelVariants();
+	for (const ImageCheck &check : checks)
+	{
+		if (image.total() * image.channels() < check.minimumChannels)
+		{
+			continue;
+		}
+		setKernelVariant(KernelVariant::SCALAR);
+		setExecutionBackend(ExecutionBackend::OPENMP);
+		Mat expected = check.reference(image);
+		for (KernelVariant variant : variants)
+		{
+			setKernelVariant(variant);
+			for (ExecutionBackend backend : AllExecutionBackends)
+			{
+				setExecutionBackend(backend);
+				for (unsigned int threads : threadCounts)
+				{
+					checkSameImage(summary, describeValidationCase(check.name, imageName, variant, parseExecutionBackend(backend), threads), expected, check.run(image, threads), check.tolerance);
+				}
+			}
+		}
+	}
+}
+
+vector<pair<string, Mat> > createSyntheticImages()
+{
+	vector<pair<string, Mat> > images;
+	RNG random(VALIDATION_SEED);
+	for (Size size : VALIDATION_IMAGE_SIZES)
+	{
+		Mat image(size, CV_8UC3);
+		random.fill(image, RNG::UNIFORM, Scalar::all(0), Scalar::all(256));
+		images.push_back(make_pair("random " + to_string(size.width) + "x" + to_string(size.height), image));
+	}
+	images.push_back(make_pair("white " + to_string(SATURATED_IMAGE_SIZE.width) + "x" + to_string(SATURATED_IMAGE_SIZE.height), Mat(SATURATED_IMAGE_SIZE, CV_8UC3, Scalar::all(255))));
+	return images;
+}
+
+// ------------------------------------------------------
+// Performance regression gate
+
+/*
+Throughput, in MB of input per second from the median of measure(), of every row kernel in every supported
+variant and of the main image kernels with the detected variant, on both backends and on every thread count of
+the benchmark sweep. The baseline is a CSV written by --update-baseline on the machine that runs the gate;
+a measurement fails when it falls more than the threshold below its baseline row. Measurements without a
+baseline row are reported and pass.
+*/
+
+struct PerformanceMeasurement
+{
+	string benchmark;
+	string variant;
+	string backend;
+	unsigned int threads;
+	double throughput;
+};
+
+string getPerformanceKey(const string &benchmark, const string &variant, const string &backend, unsigned int threads)
+{
+	return benchmark + "," + variant + "," + backend + "," + to_string(threads);
+}
+
+double getThroughput(size_t bytes, const TimingStatistics &statistics)
+{
+	return statistics.median > 0 ? bytes / statistics.median / 1e6 : 0.0;
+}
+
+vector<PerformanceMeasurement> measureKernelPerformance(const BenchmarkConfig &config)
+{
+	vector<PerformanceMeasurement> measurements;
+	size_t length = PERFORMANCE_ROW_LENGTH;
+	vector<unsigned char> bytes = createRandomBytes(length, VALIDATION_SEED);
+	vector<unsigned char> table = createRandomBytes(256, VALIDATION_SEED + 2);
+	vector<unsigned char> channels = createRandomBytes(length * 8, VALIDATION_SEED + 1);
+	vector<unsigned char> output(length);
+	vector<unsigned short> sums(length);
+	vector<float> values(length, 1.5f), outputs(length);
+	vector<pair<string, function<void()> > > kernels = {
+		{"accumulateRow", [&]() { accumulateRow(bytes.data(), sums.data(), length); }},
+		{"applyLookupTableRow", [&]() { applyLookupTableRow(bytes.data(), output.data(), length, table.data()); }},
+		{"accumulateWeightedRow", [&]() { accumulateWeightedRow(outputs.data(), values.data(), 0.25f, length); }},
+		{"embedLsbBytes", [&]() { embedLsbBytes(channels.data(), 8, bytes.data(), length); }},
+		{"extractLsbBytes", [&]() { extractLsbBytes(channels.data(), 8, output.data(), length); }},
+		{"embedPackedLsbBytes 4 bits", [&]() { embedPackedLsbBytes(channels.data(), 4, bytes.data(), length); }},
+		{"extractPackedLsbBytes 4 bits", [&]() { extractPackedLsbBytes(channels.data(), 4, output.data(), length); }}};
+	for (KernelVariant variant : getSupportedKernelVariants())
+	{
+		setKernelVariant(variant);
+		for (const auto &kernel : kernels)
+		{
+			TimingStatistics statistics = measure(config, kernel.second);
+			measurements.push_back({kernel.first, parseKernelVariant(variant), "serial", 1, getThroughput(length, statistics)});
+		}
+	}
+	return measurements;
+}
+
+vector<PerformanceMeasurement> measureImagePerformance(const BenchmarkConfig &config)
+{
+	vector<PerformanceMeasurement> measurements;
+	Mat image(PERFORMANCE_IMAGE_SIZE, CV_8UC3);
+	RNG(VALIDATION_SEED).fill(image, RNG::UNIFORM, Scalar::all(0), Scalar::all(256));
+	size_t imageBytes = image.total() * image.channels();
+	vector<unsigned char> payload = createValidationPayload(image, DEFAULT_BITS_PER_CHANNEL);
+	MappedPayload mappedPayload = {payload.data(), payload.size()};
+	Mat container = embedSerially(image, payload, DEFAULT_BITS_PER_CHANNEL);
+	Mat target;
+	vector<unsigned char> extracted;
+	for (ExecutionBackend backend : AllExecutionBackends)
+	{
+		setExecutionBackend(backend);
+		for (unsigned int threads : config.threadCounts)
+		{
+			vector<pair<string, function<void()> > > kernels = {
+				{"compressImageThreads", [&]() { size_t pixelGroupQuantity, pixelGroupQuantityPerThread; compressImageThreads(target, ImageCompressionRate::MEDIUM, pixelGroupQuantity, pixelGroupQuantityPerThread, threads); }},
+				{"gaussianBlur", [&]() { gaussianBlur(image, 2.0, threads); }},
+				{"applyContrast", [&]() { runWithOpenMPThreads(threads, [&]() { return applyContrast(image, -1, image.cols, image.rows); }); }},
+				{"parallelEmbed", [&]() { parallelEmbed(target, mappedPayload, threads, DEFAULT_BITS_PER_CHANNEL); }},
+				{"parallelExtract", [&]() { parallelExtract(container, extracted, threads); }}};
+			for (const auto &kernel : kernels)
+			{
+				TimingStatistics statistics = measure(config, kernel.second, [&]() { image.copyTo(target); });
+				measurements.push_back({kernel.first, parseKernelVariant(getKernelVariant()), parseExecutionBackend(backend), threads, getThroughput(imageBytes, statistics)});
+			}
+		}
+	}
+	return measurements;
+}
+
+// Fills baseline with the throughput of every row of the file, by getPerformanceKey(); returns false if it cannot be read
+bool readPerformanceBaseline(const string &path, map<string, double> &baseline)
+{
+	fstream file(path, ios::in);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	string line;
+	getline(file, line);
+	while (getline(file, line))
+	{
+		vector<string> values = splitColumns(line);
+		if (values.size() == 5)
+		{
+			baseline[getPerformanceKey(values[0], values[1], values[2], atoi(values[3].c_str()))] = atof(values[4].c_str());
+		}
+	}
+	return true;
+}
+
+bool writePerformanceBaseline(const string &path, const vector<PerformanceMeasurement> &measurements)
+{
+	fstream file(path, ios::out | ios::trunc);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	file << PERFORMANCE_BASELINE_COLUMNS << endl;
+	for (const PerformanceMeasurement &measurement : measurements)
+	{
+		file << measurement.benchmark << "," << measurement.variant << "," << measurement.backend << "," << measurement.threads << "," << formatBenchmarkNumber(measurement.throughput) << endl;
+	}
+	return true;
+}
+
+// Prints every measurement next to its baseline and returns how many fell below it by more than threshold
+size_t comparePerformance(const vector<PerformanceMeasurement> &measurements, const map<string, double> &baseline, double threshold)
+{
+	size_t regressions = 0;
+	for (const PerformanceMeasurement &measurement : measurements)
+	{
+		cout << measurement.benchmark << " with " << measurement.variant << " kernels, " << measurement.backend << ", " << measurement.threads << " threads: " << fixed << setprecision(1) << measurement.throughput << " MB/s";
+		auto entry = baseline.find(getPerformanceKey(measurement.benchmark, measurement.variant, measurement.backend, measurement.threads));
+		if (entry == baseline.end())
+		{
+			cout << ", no baseline" << endl;
+			continue;
+		}
+		double change = entry->second > 0 ? measurement.throughput / entry->second - 1.0 : 0.0;
+		cout << ", baseline " << entry->second << " MB/s (" << showpos << change * 100 << noshowpos << "%)";
+		if (change < -threshold)
+		{
+			++regressions;
+			cout << " REGRESSION";
+		}
+		cout << endl;
+	}
+	cout << defaultfloat << setprecision(6);
+	return regressions;
+}
+
+// ------------------------------------------------------
+// Main
+
+void printValidationUsage()
+{
+	cout << "Usage: ./validate [--threads N] [--baseline FILE] [--threshold FRACTION] [--update-baseline] [--no-performance] [image ...]" << endl;
+}
+
+bool parseValidationOptions(int argc, char **argv, ValidationOptions &options)
+{
+	options.maxThreads = max(VALIDATION_DENSE_THREADS, thread::hardware_concurrency());
+	options.baselinePath = PERFORMANCE_BASELINE_PATH;
+	options.threshold = DEFAULT_REGRESSION_THRESHOLD;
+	options.updateBaseline = false;
+	options.checkPerformance = true;
+	for (int i = 1; i < argc; ++i)
+	{
+		string argument = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (argument == "--threads" && hasValue && atoi(argv[i + 1]) > 0)
+		{
+			options.maxThreads = atoi(argv[++i]);
+		}
+		else if (argument == "--baseline" && hasValue)
+		{
+			options.baselinePath = argv[++i];
+		}
+		else if (argument == "--threshold" && hasValue && atof(argv[i + 1]) >= 0)
+		{
+			options.threshold = atof(argv[++i]);
+		}
+		else if (argument == "--update-baseline")
+		{
+			options.updateBaseline = true;
+		}
+		else if (argument == "--no-performance")
+		{
+			options.checkPerformance = false;
+		}
+		else if (argument.compare(0, 2, "--") == 0)
+		{
+			return false;
+		}
+		else
+		{
+			options.imagePaths.push_back(argument);
+		}
+	}
+	if (options.imagePaths.empty())
+	{
+		options.imagePaths = DEFAULT_VALIDATION_IMAGES;
+	}
+	return true;
+}
+
+// Exits with EXIT_FAILURE if any output differs from its reference or any throughput regressed past the threshold
+int main(int argc, char **argv)
+{
+	ValidationOptions options;
+	if (!parseValidationOptions(argc, argv, options))
+	{
+		printValidationUsage();
+		return EXIT_FAILURE;
+	}
+	KernelVariant detectedVariant = getKernelVariant();
+	ExecutionBackend initialBackend = getExecutionBackend();
+
+	ValidationSummary summary = {0, 0};
+	cout << "Validating the row kernels against the scalar variant" << endl;
+	validateKernels(summary);
+	vector<ImageCheck> checks = getImageChecks();
+	vector<unsigned int> threadCounts = getValidationThreadCounts(options.maxThreads);
+	for (const pair<string, Mat> &image : createSyntheticImages())
+	{
+		validateImage(summary, image.first, image.second, checks, threadCounts);
+	}
+	for (const string &imagePath : options.imagePaths)
+	{
+		Mat image = imread(imagePath);
+		if (image.empty())
+		{
+			recordValidationCheck(summary, "reading " + imagePath, "the image could not be read");
+			continue;
+		}
+		validateImage(summary, imagePath, image, checks, threadCounts);
+	}
+	setKernelVariant(detectedVariant);
+	setExecutionBackend(initialBackend);
+	cout << summary.checks << " checks, " << summary.failures << " failed" << endl;
+
+	size_t regressions = 0;
+	if (options.checkPerformance)
+	{
+		BenchmarkConfig config = createBenchmarkConfig(options.maxThreads);
+		vector<PerformanceMeasurement> measurements = measureKernelPerformance(config);
+		setKernelVariant(detectedVariant);
+		vector<PerformanceMeasurement> imageMeasurements = measureImagePerformance(config);
+		measurements.insert(measurements.end(), imageMeasurements.begin(), imageMeasurements.end());
+		setExecutionBackend(initialBackend);
+
+		map<string, double> baseline;
+		bool hasBaseline = readPerformanceBaseline(options.baselinePath, baseline);
+		size_t slower = comparePerformance(measurements, baseline, options.threshold);
+		if (options.updateBaseline)
+		{
+			if (!writePerformanceBaseline(options.baselinePath, measurements))
+			{
+				cout << "Error opening file " << options.baselinePath << endl;
+				return EXIT_FAILURE;
+			}
+			cout << "Baseline written to " << options.baselinePath << endl;
+		}
+		else if (hasBaseline)
+		{
+			regressions = slower;
+			cout << regressions << " of " << measurements.size() << " measurements more than " << options.threshold * 100 << "% below " << options.baselinePath << endl;
+		}
+		else
+		{
+			cout << "No baseline at " << options.baselinePath << "; run with --update-baseline to record one" << endl;
+		}
+	}
+	return summary.failures == 0 && regressions == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}